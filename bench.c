@@ -0,0 +1,249 @@
+/**
+ * Kilo benchmark: replays key scripts against a large generated file, with
+ * the editor core running headless, and reports the latency and the
+ * allocations of every keypress.
+ *
+ * usage: bench [-n rows] [script.keys ...]
+ *
+ * Without script arguments the built-in scripts run: typing, paste, scroll,
+ * search and save. A script is just the bytes a terminal sends to the
+ * editor, so a session captured with `cat > session.keys` replays as is.
+ * Every script is followed by the memory of the editor at its end.
+ */
+
+#include "kilo.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+/*** allocation counting ***/
+
+/*
+ * The Makefile links with --wrap, so every allocation the editor core asks
+ * to the libc goes through here first.
+ */
+size_t mallocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	mallocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	mallocs++;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+	mallocs++;
+	return __real_realloc(p, size);
+}
+
+size_t allocCount() {
+	return mallocs + RS.allocs;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*** generated input ***/
+
+char *sample_lines[] = {
+	"/* generated by the kilo benchmark */",
+	"#include <stdio.h>",
+	"",
+	"struct point {",
+	"\tint x, y; // coordinates",
+	"};",
+	"",
+	"static int needle_count(char *s, unsigned long len) {",
+	"\tint count = 0;",
+	"\tfor (unsigned long i = 0; i < len; i++) {",
+	"\t\tif (s[i] == '\\n' || s[i] == 'x') count += 2 * 3.5;",
+	"\t}",
+	"\t/* a comment that spans",
+	"\t   more than one row */",
+	"\treturn printf(\"%d needles\\n\", count);",
+	"}",
+	NULL
+};
+
+/*
+ * Writes a C source of about nrows rows to a temporary file and returns its name
+ */
+char *benchFile(int nrows) {
+	static char path[] = "/tmp/kilo-bench-XXXXXX.c";
+	int fd = mkstemps(path, 2);
+	if (fd == -1) die("mkstemps");
+
+	FILE *fp = fdopen(fd, "w");
+	int j = 0;
+	for (int i = 0; i < nrows; i++) {
+		if (sample_lines[j] == NULL) j = 0;
+		fprintf(fp, "%s\n", sample_lines[j++]);
+	}
+	fclose(fp);
+	return path;
+}
+
+void scriptRepeat(struct abuf *ab, const char *keys, int times) {
+	while (times--) abAppend(ab, keys, strlen(keys));
+}
+
+struct script {
+	const char *name;
+	struct abuf keys;
+};
+
+void builtinScripts(struct script *s) {
+	struct abuf ab = ABUF_INIT;
+
+	s[0].name = "typing";
+	scriptRepeat(&ab, "\tint typed = 42; // typed by hand\r", 100);
+	scriptRepeat(&ab, "\x7f", 300);
+	s[0].keys = ab;
+
+	// a terminal delivers a paste as a burst of keys, much bigger than typing
+	struct abuf paste = ABUF_INIT;
+	for (int i = 0; i < 40; i++) {
+		for (int j = 0; sample_lines[j]; j++) {
+			scriptRepeat(&paste, sample_lines[j], 1);
+			scriptRepeat(&paste, "\r", 1);
+		}
+	}
+	s[1].name = "paste";
+	s[1].keys = paste;
+
+	struct abuf scroll = ABUF_INIT;
+	scriptRepeat(&scroll, "\x1b[6~", 300);
+	scriptRepeat(&scroll, "\x1b[B\x1b[B\x1b[C\x1b[C\x1b[F\x1b[H", 200);
+	scriptRepeat(&scroll, "\x1b[5~", 300);
+	s[2].name = "scroll";
+	s[2].keys = scroll;
+
+	struct abuf search = ABUF_INIT;
+	scriptRepeat(&search, "\x06needle\x1b[B\x1b[B\x1b[B\r", 20);
+	scriptRepeat(&search, "\x06no such thing\r", 3);
+	s[3].name = "search";
+	s[3].keys = search;
+
+	struct abuf save = ABUF_INIT;
+	scriptRepeat(&save, "x\x13", 5);
+	s[4].name = "save";
+	s[4].keys = save;
+}
+
+/*** replay ***/
+
+int cmpDouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void benchReset() {
+	while (E.numrows) editorDelRow(E.numrows - 1);
+	free(E.row);
+	free(E.filename);
+	initEditor();
+	E.ofd = open("/dev/null", O_WRONLY);
+	if (E.ofd == -1) die("open");
+}
+
+/*
+ * Opens the file, replays the keys and prints one line of results. Every
+ * sample is one keypress plus the screen refresh that follows it.
+ */
+void benchScript(const char *name, struct abuf *keys, char *path) {
+	benchReset();
+
+	double start = now();
+	size_t a0 = allocCount();
+	editorOpen(path);
+	double open_time = now() - start;
+	size_t open_allocs = allocCount() - a0;
+	E.cy = E.numrows / 2;
+
+	char kpath[] = "/tmp/kilo-bench-XXXXXX.keys";
+	E.ifd = mkstemps(kpath, 5);
+	if (E.ifd == -1) die("mkstemps");
+	if (write(E.ifd, keys->b, keys->len) != keys->len) die("write");
+	lseek(E.ifd, 0, SEEK_SET);
+	unlink(kpath);
+
+	int cap = 1024, n = 0;
+	double *samples = malloc(sizeof(double) * cap);
+	size_t allocs = 0;
+	start = now();
+	while (lseek(E.ifd, 0, SEEK_CUR) < keys->len) {
+		double t = now();
+		a0 = allocCount();
+		editorProcessKeypress();
+		editorRefreshScreen();
+		allocs += allocCount() - a0;
+		if (n == cap) samples = realloc(samples, sizeof(double) * (cap *= 2));
+		samples[n++] = now() - t;
+	}
+	double total = now() - start;
+	close(E.ifd);
+	close(E.ofd);
+	editorSwapClose(); // the next script starts from the file, not from this one's edits
+
+	qsort(samples, n, sizeof(double), cmpDouble);
+	printf("%-10s %8.1f %7zu %7d %9.1f %9.1f %9.1f %9.2f %8.1f\n", name,
+		open_time * 1e3, open_allocs, n,
+		n ? samples[n / 2] * 1e6 : 0, n ? samples[(n * 99) / 100] * 1e6 : 0,
+		n ? samples[n - 1] * 1e6 : 0, n ? (double)allocs / n : 0, total * 1e3);
+	free(samples);
+
+	char stats[256];
+	editorMemStats(stats, sizeof(stats));
+	printf("%-10s %s\n", "", stats);
+}
+
+int main(int argc, char *argv[]) {
+	int nrows = 1000000;
+	int j = 1;
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		nrows = atoi(argv[2]);
+		j = 3;
+	}
+
+	initEditor();
+	char *path = benchFile(nrows);
+	printf("%d rows, latencies in microseconds per keypress\n", nrows);
+	printf("%-10s %8s %7s %7s %9s %9s %9s %9s %8s\n", "script", "open ms",
+		"allocs", "keys", "p50", "p99", "max", "allocs/k", "total ms");
+
+	if (j == argc) {
+		struct script s[5];
+		builtinScripts(s);
+		for (int i = 0; i < 5; i++) {
+			benchScript(s[i].name, &s[i].keys, path);
+			abFree(&s[i].keys);
+		}
+	}
+	for (; j < argc; j++) {
+		struct abuf keys = ABUF_INIT;
+		char buf[4096];
+		int fd = open(argv[j], O_RDONLY);
+		if (fd == -1) die(argv[j]);
+		ssize_t nread;
+		while ((nread = read(fd, buf, sizeof(buf))) > 0) abAppend(&keys, buf, nread);
+		close(fd);
+		benchScript(argv[j], &keys, path);
+		abFree(&keys);
+	}
+
+	unlink(path);
+	return 0;
+}
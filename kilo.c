@@ -13,105 +13,35 @@
 
 /*** includes ***/
 
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
-
+#include "kilo.h"
 
 #include <unistd.h>
-#include <termios.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <sys/ioctl.h>
-#include <time.h>
 #include <stdarg.h>
 #include <malloc.h>
 #include <fcntl.h>
-/*** defines ***/
-
-#define KILO_VERSION "0.0.1"
-#define KILO_TAB_STOP 4
-#define KILO_QUIT_TIMES 3
-
-#define CTRL_KEY(k) ((k) & 0x1f)
-
-enum editorKey {
-	BACKSPACE = 127,
-	ARROW_LEFT = 1000,
-	ARROW_RIGHT,
-	ARROW_UP,
-	ARROW_DOWN,
-	PAGE_UP,
-	PAGE_DOWN,
-	HOME_KEY,
-	END_KEY,
-	DEL_KEY
-};
-
-enum editorHiglight {
-	HL_NORMAL = 0,
-	HL_STRING,
-	HL_NUMBER,
-	HL_MATCH,  //search match
-	HL_COMMENT,
-	HL_MLCOMMENT,
-	HL_KEYWORD1,
-	HL_KEYWORD2
-};
-
-#define HL_HIGHLIGHT_NUMBERS (1<<0)
-#define HL_HIGHLIGHT_STRINGS (1<<1)
-
-/*** prototypes ***/ 
-
-void editorClearScreen();
-void editorSetStatusMessage(const char * format, ...);
-void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <wchar.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** data ***/
 
-typedef struct erow {
-	int idx;
-	int size;
-	int rsize;
-	char *chars;
-	char *render;
-	unsigned char *hl; 	// highlight: each value correspond to a char in render 
-					   	// and will tell if the character is part of a string, a comment, a number, ect
-	int hl_open_comment;
-} erow;
-
-struct editorConfig {
-	int cx, cy;
-	int rx;
-	int rowoff;
-	int coloff;
-	int screenrows;
-	int screencols;
-	int numrows;
-	int dirty; /* file modified but saved */
-	erow *row;
-	char *filename;
-	char statusmsg[80];
-	time_t statusmsg_time;
-	struct editorSyntax *syntax;
-	struct termios orig_termios;
-};
-
-struct editorSyntax {
-	char *filetype;
-	char **filematch; // array of strings. Each string contains a pattern to match a filename agains.
-	char **keywords;
-	char *singleline_comment_start;
-	char *multiline_comment_start;
-	char *multiline_comment_end;
-	int flags;
-};
-
 struct editorConfig E;
 
 /*** filetypes ***/
@@ -126,7 +56,8 @@ char *C_HL_keywords[] = {
   "void|", NULL //GREAT NULL terminated array
 };
 
-struct editorSyntax HLDB[] = {
+// built in, the syntax directory can add more or replace them
+struct syntaxDef HLDB[] = {
 	{
 		"c",
 		C_HL_extensions,
@@ -140,14 +71,9 @@ struct editorSyntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0])) // length of the hldb array
 
-/*** append buffer ***/
-
-struct abuf {
-	char *b;
-	int len;
-};
+struct syntaxTable ST = {NULL, 0, NULL};
 
-#define ABUF_INIT {NULL, 0}
+/*** append buffer ***/
 
 void abAppend(struct abuf *ab, const char *s, int len) {
 	char *new = realloc(ab->b, ab->len + len);
@@ -162,6 +88,352 @@ void abFree(struct abuf *ab) {
 	free(ab->b);
 }
 
+/*** row storage ***/
+
+/*
+ * Row buffers (chars, render and hl) are packed into 64KB slabs instead of
+ * being malloc'd one by one. Every slab serves a single power of two size
+ * class and keeps its own free list, so a row buffer costs no allocator
+ * header. Slabs are aligned to their size: the slab owning a buffer is found
+ * by masking the pointer, and a slab is given back to the OS as soon as its
+ * last slot is freed. Buffers bigger than the largest class go to malloc.
+ */
+
+struct rowStorage RS;
+
+int rsSizeClass(size_t size) {
+	int cls = 0;
+	while (((size_t)1 << (cls + RS_MIN_SHIFT)) < size) {
+		if (++cls == RS_CLASSES) return -1;
+	}
+	return cls;
+}
+
+size_t rsSetSlot(uintptr_t base) {
+	return (size_t)((base / RS_SLAB_SIZE) * 2654435761u) & (RS.setcap - 1);
+}
+
+void rsSetAdd(uintptr_t base) {
+	if ((RS.nslabs + 1) * 2 > RS.setcap) {
+		uintptr_t *old = RS.set;
+		size_t oldcap = RS.setcap;
+		RS.setcap = oldcap ? oldcap * 2 : 64;
+		RS.set = calloc(RS.setcap, sizeof(uintptr_t));
+		if (RS.set == NULL) die("calloc");
+		for (size_t j = 0; j < oldcap; j++) {
+			if (!old[j]) continue;
+			size_t i = rsSetSlot(old[j]);
+			while (RS.set[i]) i = (i + 1) & (RS.setcap - 1);
+			RS.set[i] = old[j];
+		}
+		free(old);
+	}
+	size_t i = rsSetSlot(base);
+	while (RS.set[i]) i = (i + 1) & (RS.setcap - 1);
+	RS.set[i] = base;
+	RS.nslabs++;
+}
+
+int rsSetFind(uintptr_t base, size_t *pos) {
+	if (RS.setcap == 0) return 0;
+	size_t i = rsSetSlot(base);
+	while (RS.set[i]) {
+		if (RS.set[i] == base) {
+			if (pos) *pos = i;
+			return 1;
+		}
+		i = (i + 1) & (RS.setcap - 1);
+	}
+	return 0;
+}
+
+void rsSetDel(uintptr_t base) {
+	size_t i;
+	if (!rsSetFind(base, &i)) return;
+	RS.set[i] = 0;
+	RS.nslabs--;
+	// shift back the following entries of the cluster, so lookups never stop early
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & (RS.setcap - 1);
+		if (!RS.set[j]) break;
+		size_t home = rsSetSlot(RS.set[j]);
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			RS.set[i] = RS.set[j];
+			RS.set[j] = 0;
+			i = j;
+		}
+	}
+}
+
+struct rsSlab *rsSlabOf(void *p) {
+	uintptr_t base = (uintptr_t)p & ~(uintptr_t)(RS_SLAB_SIZE - 1);
+	return rsSetFind(base, NULL) ? (struct rsSlab *)base : NULL;
+}
+
+void rsUnlink(struct rsSlab *s) {
+	if (s->prev) s->prev->next = s->next;
+	else RS.partial[s->cls] = s->next;
+	if (s->next) s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+}
+
+void rsPush(struct rsSlab *s) {
+	s->prev = NULL;
+	s->next = RS.partial[s->cls];
+	if (s->next) s->next->prev = s;
+	RS.partial[s->cls] = s;
+}
+
+struct rsSlab *rsNewSlab(int cls) {
+	// map twice the size and trim, to get a slab aligned to its size
+	char *m = mmap(NULL, 2 * RS_SLAB_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) return NULL;
+	uintptr_t base = ((uintptr_t)m + RS_SLAB_SIZE - 1) & ~(uintptr_t)(RS_SLAB_SIZE - 1);
+	size_t head = base - (uintptr_t)m;
+	if (head) munmap(m, head);
+	munmap((char *)base + RS_SLAB_SIZE, RS_SLAB_SIZE - head);
+
+	struct rsSlab *s = (struct rsSlab *)base;
+	s->prev = s->next = NULL;
+	s->free = NULL;
+	s->cls = cls;
+	s->draining = 0;
+	s->used = 0;
+	s->nslots = (RS_SLAB_SIZE - RS_HDR_SIZE) >> (cls + RS_MIN_SHIFT);
+	s->bump = RS_HDR_SIZE;
+	rsSetAdd(base);
+	rsPush(s);
+	return s;
+}
+
+void *rsAlloc(size_t size, int kind) {
+	int cls = rsSizeClass(size);
+	RS.allocs++;
+	if (cls == -1) {
+		void *p = malloc(size);
+		if (p == NULL) die("malloc");
+		RS.kind_bytes[kind] += malloc_usable_size(p);
+		return p;
+	}
+
+	struct rsSlab *s = RS.partial[cls];
+	if (s == NULL && (s = rsNewSlab(cls)) == NULL) die("mmap");
+	if (s == RS.empty[cls]) RS.empty[cls] = NULL;
+
+	void *p;
+	if (s->free) {
+		p = s->free;
+		s->free = *(void **)p;
+	} else {
+		p = (char *)s + s->bump;
+		s->bump += 1 << (cls + RS_MIN_SHIFT);
+	}
+	if (++s->used == s->nslots) rsUnlink(s);
+	RS.used_bytes += 1 << (cls + RS_MIN_SHIFT);
+	RS.kind_bytes[kind] += 1 << (cls + RS_MIN_SHIFT);
+	return p;
+}
+
+// bytes really taken by the buffer p
+size_t rsSize(void *p) {
+	struct rsSlab *s = rsSlabOf(p);
+	return s ? (size_t)1 << (s->cls + RS_MIN_SHIFT) : malloc_usable_size(p);
+}
+
+// gives the empty slab s back to the OS
+void rsRelease(struct rsSlab *s) {
+	if (!s->draining) rsUnlink(s); // draining slabs are on no list
+	if (RS.empty[s->cls] == s) RS.empty[s->cls] = NULL;
+	rsSetDel((uintptr_t)s);
+	munmap(s, RS_SLAB_SIZE);
+	RS.released++;
+}
+
+void rsFree(void *p, int kind) {
+	if (p == NULL) return;
+
+	struct rsSlab *s = rsSlabOf(p);
+	if (s == NULL) {
+		RS.kind_bytes[kind] -= malloc_usable_size(p);
+		free(p);
+		return;
+	}
+
+	*(void **)p = s->free;
+	s->free = p;
+	RS.used_bytes -= 1 << (s->cls + RS_MIN_SHIFT);
+	RS.kind_bytes[kind] -= 1 << (s->cls + RS_MIN_SHIFT);
+	if (s->used-- == s->nslots) rsPush(s);
+	if (s->used == 0) {
+		// a class keeps one empty slab, or a buffer freed and taken again over
+		// and over would cost an munmap and an mmap every time
+		if (s->draining || (RS.empty[s->cls] && RS.empty[s->cls] != s)) rsRelease(s);
+		else RS.empty[s->cls] = s;
+	}
+}
+
+void *rsRealloc(void *p, size_t size, int kind) {
+	if (p == NULL) return rsAlloc(size, kind);
+
+	struct rsSlab *s = rsSlabOf(p);
+	int cls = rsSizeClass(size);
+	size_t oldsize;
+	if (s) {
+		if (s->cls == cls) return p;
+		oldsize = (size_t)1 << (s->cls + RS_MIN_SHIFT);
+	} else {
+		if (cls == -1) {
+			RS.kind_bytes[kind] -= malloc_usable_size(p);
+			void *new = realloc(p, size);
+			if (new == NULL) die("realloc");
+			RS.kind_bytes[kind] += malloc_usable_size(new);
+			return new;
+		}
+		oldsize = malloc_usable_size(p);
+	}
+
+	void *new = rsAlloc(size, kind);
+	memcpy(new, p, oldsize < size ? oldsize : size);
+	rsFree(p, kind);
+	return new;
+}
+
+// moves the accounting of the buffer p from a kind to another
+void rsRetag(void *p, int from, int to) {
+	if (p == NULL) return;
+	size_t size = rsSize(p);
+	RS.kind_bytes[from] -= size;
+	RS.kind_bytes[to] += size;
+}
+
+/*
+ * Compaction: the slabs less than a quarter full are drained, that is taken
+ * off the lists of their class, so that rsMove can copy their buffers into
+ * fuller slabs. A drained slab is given back as soon as it is empty, the
+ * ones still holding something when rsUndrain is called take buffers again.
+ * A class with a single sparse slab is left alone, moving its buffers would
+ * just take another slab. The empty slabs kept for reuse are given back first.
+ */
+int rsDrain() {
+	for (int cls = 0; cls < RS_CLASSES; cls++) {
+		if (RS.empty[cls]) rsRelease(RS.empty[cls]);
+	}
+
+	int sparse[RS_CLASSES] = {0};
+	for (size_t j = 0; j < RS.setcap; j++) {
+		struct rsSlab *s = (struct rsSlab *)RS.set[j];
+		if (s && s->used * 4 <= s->nslots) sparse[s->cls]++;
+	}
+
+	int drained = 0;
+	for (size_t j = 0; j < RS.setcap; j++) {
+		struct rsSlab *s = (struct rsSlab *)RS.set[j];
+		if (s == NULL || s->used * 4 > s->nslots || sparse[s->cls] < 2) continue;
+		rsUnlink(s);
+		s->draining = 1;
+		drained++;
+	}
+	return drained;
+}
+
+void *rsMove(void *p, int kind) {
+	if (p == NULL) return NULL;
+	struct rsSlab *s = rsSlabOf(p);
+	if (s == NULL || !s->draining) return p;
+
+	size_t size = (size_t)1 << (s->cls + RS_MIN_SHIFT);
+	void *new = rsAlloc(size, kind);
+	memcpy(new, p, size);
+	rsFree(p, kind);
+	return new;
+}
+
+void rsUndrain() {
+	for (size_t j = 0; j < RS.setcap; j++) {
+		struct rsSlab *s = (struct rsSlab *)RS.set[j];
+		if (s == NULL || !s->draining) continue;
+		s->draining = 0;
+		rsPush(s);
+	}
+}
+
+/*** timing ***/
+
+struct frameTiming FT;
+
+char *timing_names[TM_SERIES] = {"decode", "key", "scroll", "draw", "write", "bytes"};
+
+// microseconds, on a clock that never goes back
+double timingNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Records one sample, and a complete event in the trace when there is one.
+ * A TM_WRITE sample must be followed by the TM_BYTES sample of the write.
+ */
+void timingAdd(int series, double start, double dur) {
+	FT.samples[series][FT.count[series]++ % KILO_TIMING_FRAMES] = dur;
+	if (FT.trace == NULL) return;
+
+	if (series == TM_BYTES) {
+		fprintf(FT.trace, "{\"name\":\"bytes\",\"ph\":\"C\",\"ts\":%.3f,"
+			"\"pid\":1,\"tid\":1,\"args\":{\"bytes\":%.0f}},\n", start, dur);
+		fflush(FT.trace); // once per frame: a killed editor still leaves its trace
+	} else {
+		fprintf(FT.trace, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			"\"pid\":1,\"tid\":1},\n", timing_names[series], start, dur);
+	}
+}
+
+int cmpSample(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// p between 0 and 1, over the last KILO_TIMING_FRAMES samples
+double timingPercentile(int series, double p) {
+	int n = FT.count[series] < KILO_TIMING_FRAMES ? FT.count[series] : KILO_TIMING_FRAMES;
+	if (n == 0) return 0;
+
+	double sorted[KILO_TIMING_FRAMES];
+	memcpy(sorted, FT.samples[series], sizeof(double) * n);
+	qsort(sorted, n, sizeof(double), cmpSample);
+	return sorted[(int)(p * (n - 1))];
+}
+
+/*
+ * p50/p99 of every phase, in us, and of the bytes written per frame
+ */
+int timingStats(char *buf, size_t len) {
+	int n = snprintf(buf, len, "p50/p99 us:");
+	for (int s = 0; s < TM_BYTES && n < (int)len; s++) {
+		n += snprintf(buf + n, len - n, " %s %.0f/%.0f", timing_names[s],
+			timingPercentile(s, 0.5), timingPercentile(s, 0.99));
+	}
+	if (n < (int)len) {
+		n += snprintf(buf + n, len - n, " | %.0f/%.0f bytes",
+			timingPercentile(TM_BYTES, 0.5), timingPercentile(TM_BYTES, 0.99));
+	}
+	return n;
+}
+
+/*
+ * Starts a trace in the chrome trace event format, it can be loaded in
+ * chrome://tracing or in perfetto. The closing bracket is optional in that
+ * format, so the file is valid whenever the editor stops.
+ */
+int timingTrace(const char *path) {
+	FT.trace = fopen(path, "w");
+	if (FT.trace == NULL) return -1;
+	fprintf(FT.trace, "[\n");
+	return 0;
+}
+
 
 /*** terminal ***/
 
@@ -172,13 +444,13 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
+	if (tcsetattr(E.ifd, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
 }
 
 
 void enableRawMode() {
 	
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
+	if (tcgetattr(E.ifd, &E.orig_termios) == -1) die("tcgetattr");
 	atexit(disableRawMode);
 	struct termios raw = E.orig_termios;
 
@@ -189,23 +461,20 @@ void enableRawMode() {
 	raw.c_cc[VMIN] = 0;
 	raw.c_cc[VTIME] = 1;
 
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)	die("tcsetattr");
+	if (tcsetattr(E.ifd, TCSAFLUSH, &raw) == -1)	die("tcsetattr");
 }
 
-int editorReadKey() {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
-	}
-
+/*
+ * Turns the escape sequence that starts with c into a key
+ */
+int editorDecodeKey(char c) {
 	if (c == '\x1b') {
 		char seq[3];
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		if (read(E.ifd, &seq[0], 1) != 1) return '\x1b';
+		if (read(E.ifd, &seq[1], 1) != 1) return '\x1b';
 		if (seq[0] == '[') {
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+				if (read(E.ifd, &seq[2], 1) != 1) return '\x1b';
 				if (seq[2] == '~') {
 					switch(seq[1]) {
 						case '1': return HOME_KEY;
@@ -238,19 +507,51 @@ int editorReadKey() {
 		return '\x1b';		
 	} 
 	else {	
-		return c;
+		return (unsigned char)c; // bytes of UTF-8 chars are keys above 127
+	}
+}
+
+/*
+ * Waits for a key, at most as long as the terminal would, while watching
+ * the followed file or the stream. Returns whether a key can be read. While
+ * a filtered view is being built, it does not wait at all.
+ */
+int editorKeyWait() {
+	int building = FV.active && FV.scanned < E.numrows;
+	if (FL.fd == -1 && !building) return 1;
+	struct pollfd fds[2] = {{E.ifd, POLLIN, 0}, {FL.stream ? FL.fd : FL.ifd, POLLIN, 0}};
+	if (poll(fds, FL.fd == -1 || fds[1].fd == -1 ? 1 : 2, building ? 0 : 100) <= 0) return 0;
+	return fds[0].revents != 0;
+}
+
+int editorReadKey() {
+	int nread;
+	char c;
+	double wait = timingNow();
+	while ((nread = editorKeyWait() ? read(E.ifd, &c, 1) : 0) != 1) {
+		if (nread == -1 && errno != EAGAIN) die("read");
+		editorSwapTick();
+		editorDiskCheck();
+		if (editorFollowPoll() | editorFilterStep()) editorRefreshScreen();
+		if (nread == 0 && !isatty(E.ifd)) return '\x1b'; // end of a key script: ESC gets out of any prompt
 	}
+
+	double start = timingNow();
+	FT.waited += start - wait;
+	int key = editorDecodeKey(c);
+	timingAdd(TM_DECODE, start, timingNow() - start);
+	return key;
 }
 
 int getCursorPosition(int *rows, int *cols) {
 	char buf[32];
 	unsigned int i = 0;
 
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+	if (write(E.ofd, "\x1b[6n", 4) != 4) return -1;
 
 	
 	while (i < sizeof(buf) -1) {
-		if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+		if (read(E.ifd, &buf[i], 1) != 1) break;
 		if (buf[i] == 'R') break;
 		i++;		
 	}
@@ -263,8 +564,8 @@ int getCursorPosition(int *rows, int *cols) {
 int getWindowSize(int *rows, int *cols) {
 	struct winsize ws;
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+	if (ioctl(E.ofd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+		if (write(E.ofd, "\x1b[999C\x1b[999B", 12) != 12) return -1;
 		return getCursorPosition(rows, cols);
 	}
 	else {
@@ -274,425 +575,3141 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }
 
-/*** syntax highlighting ***/
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
-
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-
-	if (E.syntax == NULL) return; // no syntax no party
-
-	char **keywords = E.syntax->keywords;
-
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
-
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+/*** syntax table ***/
 
-	int prev_sep = 1; // initialized to true because the beginning of the line is a separator
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment); //inside a MULTILINE comment
+/*
+ * Syntaxes beyond the built in ones are files of the syntax directory, one
+ * per language, named like "python.syntax". Every line is a key and words:
+ *
+ *   filetype python
+ *   match .py .pyw SConstruct
+ *   comment #
+ *   flags numbers strings
+ *   keywords def class if elif else for while return import from
+ *   types int str list dict
+ *
+ * "multiline" takes the start and the end of a block comment, "types" are
+ * the second type of keyword, "match" patterns that don't start with a dot
+ * match anywhere in the file name. A file with the filetype of an earlier
+ * syntax replaces it.
+ *
+ * The definitions are compiled in one block, see syntaxHeader, that is
+ * saved as ".syntax.cache" in the directory: the next launches mmap it and
+ * only stat the definitions to know it is still good.
+ */
 
-	int i = 0;
-	while (i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+// appends s and its NUL to the block, returns its offset
+uint32_t syntaxString(struct abuf *ab, const char *s) {
+	if (s == NULL) return 0;
+	uint32_t off = ab->len;
+	abAppend(ab, s, strlen(s) + 1);
+	return off;
+}
 
-		if (scs_len && !in_string && !in_comment) {
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		}
+// slots of a hash table for n keys: a power of two, at least half empty
+uint32_t syntaxSlots(int n) {
+	uint32_t slots = 1;
+	while (slots < 2 * (uint32_t)n) slots <<= 1;
+	return slots;
+}
 
-		if (mcs_len && mce_len && !in_string) {
-			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-					continue;
-				} else {
-					i++;
-					continue;
-				}
-			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
-		}
+/*
+ * Slot of the string s (len chars) in a hash table of mask + 1 slots, step
+ * uint32_t apart, that start with the offset in base of a key: the slot of
+ * s, or the empty one where it goes. A pipe ending a key is not part of it.
+ */
+uint32_t *syntaxProbe(char *base, uint32_t *slots, uint32_t mask, int step, const char *s, int len) {
+	for (uint32_t j = editorLineHash(s, len) & mask;; j = (j + 1) & mask) {
+		uint32_t *slot = &slots[j * step];
+		if (*slot == 0) return slot;
+		char *key = base + *slot;
+		int klen = strlen(key);
+		if (klen && key[klen - 1] == '|') klen--;
+		if (klen == len && !memcmp(key, s, len)) return slot;
+	}
+}
 
+/*
+ * The keyword of the syntax that is the len chars at s, with its pipe if it
+ * is of the second type, NULL if they aren't one
+ */
+char *editorSyntaxKeyword(struct editorSyntax *syntax, const char *s, int len) {
+	uint32_t *slot = syntaxProbe(ST.image, syntax->keywords, syntax->kwmask, 1, s, len);
+	return *slot ? ST.image + *slot : NULL;
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string) in_string = 0; //in_string is equal to " or ', so, if it's a match, it's a closing quote 
-				i++;
-				prev_sep = 1;
-				continue;
-			}
-			else {
-				if (c == '"' || c == '\'') {
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
+/*
+ * Compiles n definitions in a block of *size bytes, to be freed by the
+ * caller. A later definition takes the extensions of the earlier ones.
+ */
+char *editorSyntaxCompile(struct syntaxDef **defs, int n, uint64_t stamp, size_t *size) {
+	struct abuf ab = ABUF_INIT;
+	syntaxHeader h;
+	memset(&h, 0, sizeof(h));
+	abAppend(&ab, (char *)&h, sizeof(h)); // filled at the end, the strings follow
+
+	int nexts = 0;
+	for (int j = 0; j < n; j++) {
+		for (char **m = defs[j]->filematch; m && *m; m++) {
+			if ((*m)[0] == '.') nexts++;
+			else h.npatterns++;
 		}
-
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			//TODO: maybe use a regular expression instead of this?
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-				(c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0; 
-				continue;
-			}
+	}
+	h.extmask = syntaxSlots(nexts) - 1;
+	uint32_t *exts = calloc(2 * (h.extmask + 1), sizeof(uint32_t));
+	uint32_t *patterns = calloc(2 * h.npatterns + 1, sizeof(uint32_t));
+	syntaxEntry *entries = calloc(n, sizeof(syntaxEntry));
+	uint32_t **keywords = calloc(n, sizeof(uint32_t *));
+	if (!exts || !patterns || !entries || !keywords) die("calloc");
+
+	int np = 0;
+	for (int j = 0; j < n; j++) {
+		struct syntaxDef *d = defs[j];
+		syntaxEntry *e = &entries[j];
+		e->filetype = syntaxString(&ab, d->filetype);
+		e->singleline_comment_start = syntaxString(&ab, d->singleline_comment_start);
+		e->multiline_comment_start = syntaxString(&ab, d->multiline_comment_start);
+		e->multiline_comment_end = syntaxString(&ab, d->multiline_comment_end);
+		e->flags = d->flags;
+
+		int nk = 0;
+		while (d->keywords && d->keywords[nk]) nk++;
+		e->kwmask = syntaxSlots(nk) - 1;
+		keywords[j] = calloc(e->kwmask + 1, sizeof(uint32_t));
+		if (keywords[j] == NULL) die("calloc");
+		for (int k = 0; k < nk; k++) {
+			char *kw = d->keywords[k];
+			int klen = strlen(kw);
+			if (klen && kw[klen - 1] == '|') klen--;
+			uint32_t *slot = syntaxProbe(ab.b, keywords[j], e->kwmask, 1, kw, klen);
+			if (*slot == 0 && klen) *slot = syntaxString(&ab, kw);
 		}
 
-		if (prev_sep) {
-			int j = 0;
-			char *keyword;
-			while ((keyword = keywords[j])) {
-				int klen = strlen(keyword);
-				int is_kw2 = keyword[klen - 1] == '|';
-				if (is_kw2) klen--;
-
-				if (!strncmp(&row->render[i], keyword, klen) &&
-					is_separator(row->render[i + klen])) {
-					memset(&row->hl[i], is_kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-				j++;
-			}
-			if (keyword != NULL) {
-				prev_sep = 0;
-				continue;
+		for (char **m = d->filematch; m && *m; m++) {
+			if ((*m)[0] == '.') {
+				uint32_t *slot = syntaxProbe(ab.b, exts, h.extmask, 2, *m, strlen(*m));
+				if (*slot == 0) slot[0] = syntaxString(&ab, *m);
+				slot[1] = j;
+			} else {
+				patterns[2 * np] = syntaxString(&ab, *m);
+				patterns[2 * np + 1] = j;
+				np++;
 			}
 		}
-
-
-		prev_sep = is_separator(c); 
-		i++;
 	}
 
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.numrows) {
-		
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+	// the tables are uint32_t: aligned after the strings, the entries last
+	// since they point to the keywords
+	while (ab.len % sizeof(uint64_t)) abAppend(&ab, "", 1);
+	for (int j = 0; j < n; j++) {
+		entries[j].keywords = ab.len;
+		abAppend(&ab, (char *)keywords[j], sizeof(uint32_t) * (entries[j].kwmask + 1));
+		free(keywords[j]);
 	}
+	h.exts = ab.len;
+	abAppend(&ab, (char *)exts, sizeof(uint32_t) * 2 * (h.extmask + 1));
+	h.patterns = ab.len;
+	abAppend(&ab, (char *)patterns, sizeof(uint32_t) * 2 * h.npatterns);
+	h.syntaxes = ab.len;
+	abAppend(&ab, (char *)entries, sizeof(syntaxEntry) * n);
+
+	memcpy(h.magic, KILO_SYNTAX_MAGIC, sizeof(h.magic));
+	h.stamp = stamp;
+	h.size = ab.len;
+	h.nsyntax = n;
+	memcpy(ab.b, &h, sizeof(h));
+	free(exts);
+	free(patterns);
+	free(entries);
+	free(keywords);
+	*size = ab.len;
+	return ab.b;
 }
 
-int editorSyntaxToColor(int hl) {
-	switch(hl) {
-		case HL_NUMBER: return 196;
-		case HL_STRING: return 5;
-		case HL_MATCH: return 27;
-		case HL_MLCOMMENT:
-		case HL_COMMENT: return 6;
-		case HL_KEYWORD1: return 11;
-		case HL_KEYWORD2: return 10;
-		
+char *syntaxImageString(uint32_t off) {
+	return off ? ST.image + off : NULL;
+}
 
-		default: return 37;
+// the compiled block becomes the syntax table
+void editorSyntaxUse(char *image, size_t size) {
+	ST.image = image;
+	ST.size = size;
+
+	syntaxHeader *h = (syntaxHeader *)image;
+	syntaxEntry *e = (syntaxEntry *)(image + h->syntaxes);
+	ST.syntaxes = malloc(sizeof(struct editorSyntax) * h->nsyntax);
+	if (ST.syntaxes == NULL) die("malloc");
+	for (uint32_t j = 0; j < h->nsyntax; j++) {
+		struct editorSyntax *s = &ST.syntaxes[j];
+		s->filetype = syntaxImageString(e[j].filetype);
+		s->singleline_comment_start = syntaxImageString(e[j].singleline_comment_start);
+		s->multiline_comment_start = syntaxImageString(e[j].multiline_comment_start);
+		s->multiline_comment_end = syntaxImageString(e[j].multiline_comment_end);
+		s->flags = e[j].flags;
+		s->keywords = (uint32_t *)(image + e[j].keywords);
+		s->kwmask = e[j].kwmask;
 	}
 }
 
-void editorSelectSyntaxHighlight() {
-	E.syntax = NULL;
-	if (E.filename == NULL) return;
-
-	char *ext = strrchr(E.filename, '.');
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i]) {
-			int is_ext = (s->filematch[i][0] == '.');
-			// check if it's a match with file extension pattern or 
-			// with a pattern anywhere in the filename
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-				(!is_ext && strstr(E.filename, s->filematch[i]))) {
-				E.syntax = s;
-
-				int filerow;
-				for(filerow = 0; filerow < E.numrows; filerow++) {
-					editorUpdateSyntax(&E.row[filerow]);
-				}
-
-				return;
-			}
-			i++;
-		}
-
-	}
+// a string offset of the block: 0, or one whose string ends inside it
+int syntaxStringValid(char *image, size_t size, uint32_t off) {
+	return off == 0 || (off < size && memchr(image + off, '\0', size - off));
 }
 
-/*** row operations ***/
 /*
- * Character index to render index
+ * Whether the n entries of step uint32_t at off are inside the block, and
+ * start with a string offset and, when step is 2, the index of a syntax
  */
-int editorRowCxToRx(erow *row, int cx) {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t') {
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		}
-		rx++;
+int syntaxSlotsValid(char *image, size_t size, uint32_t off, uint64_t n, int step, uint32_t nsyntax) {
+	if (off % sizeof(uint32_t) || off + n * step * sizeof(uint32_t) > size) return 0;
+	uint32_t *slots = (uint32_t *)(image + off);
+	for (uint64_t j = 0; j < n; j++) {
+		if (!syntaxStringValid(image, size, slots[j * step])) return 0;
+		if (step == 2 && slots[j * 2] && slots[j * 2 + 1] >= nsyntax) return 0;
+	}
+	return 1;
+}
+
+// a hash table: valid slots, a power of two of them, and an empty one to end the probes
+int syntaxTableValid(char *image, size_t size, uint32_t off, uint32_t mask, int step, uint32_t nsyntax) {
+	uint64_t n = (uint64_t)mask + 1;
+	if (n & (n - 1) || !syntaxSlotsValid(image, size, off, n, step, nsyntax)) return 0;
+	uint32_t *slots = (uint32_t *)(image + off);
+	for (uint64_t j = 0; j < n; j++) {
+		if (slots[j * step] == 0) return 1;
 	}
-	return rx;
+	return 0;
 }
 
 /*
- * Render index to character indes
+ * Whether every offset of the block points inside it, so that a cache
+ * damaged in the middle is compiled again instead of read out of bounds
  */
-int editorRowRxToCx(erow *row, int rx) {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t') 
-			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-		cur_rx++;
+int editorSyntaxValid(char *image, size_t size) {
+	syntaxHeader *h = (syntaxHeader *)image;
+	if (h->nsyntax == 0 || h->syntaxes % sizeof(uint32_t) ||
+		h->syntaxes + (uint64_t)h->nsyntax * sizeof(syntaxEntry) > size ||
+		!syntaxTableValid(image, size, h->exts, h->extmask, 2, h->nsyntax) ||
+		!syntaxSlotsValid(image, size, h->patterns, h->npatterns, 2, h->nsyntax))
+		return 0;
+	for (uint32_t j = 0; j < h->npatterns; j++) {
+		if (((uint32_t *)(image + h->patterns))[2 * j] == 0) return 0;
+	}
 
-		if (cur_rx > rx) return cx;
+	syntaxEntry *e = (syntaxEntry *)(image + h->syntaxes);
+	for (uint32_t j = 0; j < h->nsyntax; j++) {
+		if (!syntaxStringValid(image, size, e[j].filetype) ||
+			!syntaxStringValid(image, size, e[j].singleline_comment_start) ||
+			!syntaxStringValid(image, size, e[j].multiline_comment_start) ||
+			!syntaxStringValid(image, size, e[j].multiline_comment_end) ||
+			!syntaxTableValid(image, size, e[j].keywords, e[j].kwmask, 1, h->nsyntax))
+			return 0;
 	}
-	return cx;
+	return 1;
 }
 
-void editorUpdateRow(erow *row) {
-
-	int tabs = 0;
-	int j = 0;
-	for (j=0; j < row->size; j++) {
-		if (row->chars[j] == '\t') tabs++;
+// maps the cache at path if it was compiled from the definitions of stamp
+int editorSyntaxMap(const char *path, uint64_t stamp) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return 0;
+	struct stat st;
+	char *image = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(syntaxHeader))
+		image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) return 0;
+
+	syntaxHeader *h = (syntaxHeader *)image;
+	if (memcmp(h->magic, KILO_SYNTAX_MAGIC, sizeof(h->magic)) || h->stamp != stamp ||
+		h->size != (uint64_t)st.st_size || !editorSyntaxValid(image, st.st_size)) {
+		munmap(image, st.st_size);
+		return 0;
 	}
+	editorSyntaxUse(image, st.st_size);
+	return 1;
+}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+void syntaxListAdd(char ***list, int *n, char *s) {
+	char **new = realloc(*list, sizeof(char *) * (*n + 2));
+	if (new == NULL) die("realloc");
+	new[(*n)++] = s;
+	new[*n] = NULL;
+	*list = new;
+}
 
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-		}
+/*
+ * Reads the definition in the file at path, named name. Returns -1 if it
+ * can't be read.
+ */
+int editorSyntaxParse(const char *path, const char *name, struct syntaxDef *d) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) return -1;
+	memset(d, 0, sizeof(*d));
+	int nmatch = 0, nkeywords = 0;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	while (getline(&line, &linecap, fp) != -1) {
+		char *save;
+		char *key = strtok_r(line, " \t\r\n", &save);
+		if (key == NULL || key[0] == '#') continue;
+		char *word;
+		for (int w = 0; (word = strtok_r(NULL, " \t\r\n", &save)); w++) {
+			char **one = NULL;
+			if (!strcmp(key, "filetype") && w == 0) one = &d->filetype;
+			else if (!strcmp(key, "comment") && w == 0) one = &d->singleline_comment_start;
+			else if (!strcmp(key, "multiline") && w == 0) one = &d->multiline_comment_start;
+			else if (!strcmp(key, "multiline") && w == 1) one = &d->multiline_comment_end;
+			else if (!strcmp(key, "match")) syntaxListAdd(&d->filematch, &nmatch, strdup(word));
+			else if (!strcmp(key, "keywords")) syntaxListAdd(&d->keywords, &nkeywords, strdup(word));
+			else if (!strcmp(key, "types")) {
+				char *kw = malloc(strlen(word) + 2);
+				if (kw == NULL) die("malloc");
+				sprintf(kw, "%s|", word);
+				syntaxListAdd(&d->keywords, &nkeywords, kw);
+			} else if (!strcmp(key, "flags")) {
+				if (!strcmp(word, "numbers")) d->flags |= HL_HIGHLIGHT_NUMBERS;
+				if (!strcmp(word, "strings")) d->flags |= HL_HIGHLIGHT_STRINGS;
+			}
+			if (one) {
+				free(*one);
+				*one = strdup(word);
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (d->filetype == NULL) d->filetype = strndup(name, strlen(name) - strlen(".syntax"));
+	return 0;
+}
+
+void syntaxDefFree(struct syntaxDef *d) {
+	free(d->filetype);
+	free(d->singleline_comment_start);
+	free(d->multiline_comment_start);
+	free(d->multiline_comment_end);
+	for (char **m = d->filematch; m && *m; m++) free(*m);
+	for (char **k = d->keywords; k && *k; k++) free(*k);
+	free(d->filematch);
+	free(d->keywords);
+}
+
+uint64_t syntaxHashMix(uint64_t h, const char *s) {
+	return h * 31 + (s ? editorLineHash(s, strlen(s)) : 0);
+}
+
+int syntaxNameCmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Loads the syntax table: the built in syntaxes and the ones in dir, from
+ * the cache when it is still good. dir may be NULL. Does nothing once a
+ * table is loaded.
+ */
+void editorSyntaxInit(const char *dir) {
+	if (ST.image) return;
+
+	// the stamp covers what the table is compiled from, built in or not
+	uint64_t stamp = 0;
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+		struct syntaxDef *d = &HLDB[j];
+		stamp = syntaxHashMix(stamp, d->filetype);
+		stamp = syntaxHashMix(stamp, d->singleline_comment_start);
+		stamp = syntaxHashMix(stamp, d->multiline_comment_start);
+		stamp = syntaxHashMix(stamp, d->multiline_comment_end);
+		stamp = stamp * 31 + d->flags;
+		for (char **m = d->filematch; *m; m++) stamp = syntaxHashMix(stamp, *m);
+		for (char **k = d->keywords; *k; k++) stamp = syntaxHashMix(stamp, *k);
+	}
+
+	char **names = NULL;
+	int nnames = 0;
+	DIR *dp = dir ? opendir(dir) : NULL;
+	if (dp) {
+		struct dirent *de;
+		while ((de = readdir(dp))) {
+			int len = strlen(de->d_name);
+			if (len > 7 && !strcmp(de->d_name + len - 7, ".syntax"))
+				syntaxListAdd(&names, &nnames, strdup(de->d_name));
+		}
+		closedir(dp);
+	}
+	if (nnames) qsort(names, nnames, sizeof(char *), syntaxNameCmp);
+
+	char **paths = calloc(nnames + 1, sizeof(char *));
+	if (paths == NULL) die("calloc");
+	for (int j = 0; j < nnames; j++) {
+		paths[j] = malloc(strlen(dir) + strlen(names[j]) + 2);
+		if (paths[j] == NULL) die("malloc");
+		sprintf(paths[j], "%s/%s", dir, names[j]);
+		struct stat st;
+		if (stat(paths[j], &st) == -1) continue;
+		stamp = syntaxHashMix(stamp, names[j]);
+		stamp = stamp * 31 + st.st_size;
+		stamp = stamp * 31 + st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	}
+
+	char *cache = NULL;
+	if (dp) {
+		cache = malloc(strlen(dir) + strlen("/.syntax.cache") + 1);
+		if (cache == NULL) die("malloc");
+		sprintf(cache, "%s/.syntax.cache", dir);
+	}
+
+	if (cache == NULL || !editorSyntaxMap(cache, stamp)) {
+		struct syntaxDef **defs = malloc(sizeof(struct syntaxDef *) * (HLDB_ENTRIES + nnames));
+		struct syntaxDef *parsed = calloc(nnames + 1, sizeof(struct syntaxDef));
+		if (defs == NULL || parsed == NULL) die("malloc");
+		int n = 0;
+		for (unsigned int j = 0; j < HLDB_ENTRIES; j++) defs[n++] = &HLDB[j];
+		for (int j = 0; j < nnames; j++) {
+			if (editorSyntaxParse(paths[j], names[j], &parsed[j]) == -1) continue;
+			int k = 0;
+			while (k < n && strcmp(defs[k]->filetype, parsed[j].filetype)) k++;
+			defs[k] = &parsed[j];
+			if (k == n) n++;
+		}
+
+		size_t size;
+		char *image = editorSyntaxCompile(defs, n, stamp, &size);
+		for (int j = 0; j < nnames; j++) syntaxDefFree(&parsed[j]);
+		free(parsed);
+		free(defs);
+
+		// a launch sees the old cache or the new one, never half of one
+		if (cache) {
+			char *tmp = malloc(strlen(cache) + 5);
+			if (tmp == NULL) die("malloc");
+			sprintf(tmp, "%s.new", cache);
+			int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd != -1) {
+				int ok = write(fd, image, size) == (ssize_t)size;
+				close(fd);
+				if (!ok || rename(tmp, cache) == -1) unlink(tmp);
+			}
+			free(tmp);
+		}
+		editorSyntaxUse(image, size);
+	}
+
+	for (int j = 0; j < nnames; j++) {
+		free(names[j]);
+		free(paths[j]);
+	}
+	free(names);
+	free(paths);
+	free(cache);
+}
+
+/*** syntax highlighting ***/
+int is_separator(int c) {
+	static char sep[256]; // the highlighter asks for every char, so it's a table lookup
+	static int init = 0;
+	if (!init) {
+		for (int j = 0; j < 256; j++) 
+			sep[j] = isspace(j) || j == '\0' || strchr(",.()+-/*=~%<>[];", j) != NULL;
+		init = 1;
+	}
+	return sep[(unsigned char)c];
+}
+
+/*
+ * Highlighting is computed one byte per render char in a scratch buffer
+ * shared by all the rows, and only the resulting runs are kept in the row.
+ */
+unsigned char *hl_scratch = NULL;
+int hl_scratch_cap = 0;
+
+unsigned char *editorHlScratch(int len) {
+	if (len + 1 > hl_scratch_cap) {
+		hl_scratch_cap = (len + 1) * 2;
+		hl_scratch = rsRealloc(hl_scratch, hl_scratch_cap, MEM_HL);
+	}
+	return hl_scratch;
+}
+
+/*
+ * Replaces the spans of the row with the runs found in hl, that holds the
+ * highlight of len render chars starting at render position off.
+ */
+void editorRowSetSpans(erow *row, unsigned char *hl, int off, int len) {
+	int n = 0;
+	int i;
+	for (i = 0; i < len; i++) {
+		if (hl[i] != HL_NORMAL && (i == 0 || hl[i - 1] != hl[i])) n++;
+	}
+
+	rsFree(row->hl, MEM_HL);
+	row->hl = n ? rsAlloc(sizeof(hlspan) * n, MEM_HL) : NULL;
+	row->nhl = n;
+
+	n = 0;
+	i = 0;
+	while (i < len) {
+		int j = i + 1;
+		while (j < len && hl[j] == hl[i]) j++;
+		if (hl[i] != HL_NORMAL) {
+			row->hl[n].start = off + i;
+			row->hl[n].len = j - i;
+			row->hl[n].hl = hl[i];
+			n++;
+		}
+		i = j;
+	}
+}
+
+/*
+ * Index of the first span that ends after the render position at
+ */
+int editorRowSpanAt(erow *row, int at) {
+	int lo = 0, hi = row->nhl;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->hl[mid].start + row->hl[mid].len <= at) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Render position of render[0]: long rows only keep a window of their render
+ */
+int editorRowRoff(erow *row) {
+	return row->ll ? row->ll->roff : 0;
+}
+
+void editorRowSpansToHl(erow *row, unsigned char *hl) {
+	int roff = editorRowRoff(row);
+	memset(hl, HL_NORMAL, row->rsize);
+	for (int j = 0; j < row->nhl; j++) {
+		memset(&hl[row->hl[j].start - roff], row->hl[j].hl, row->hl[j].len);
+	}
+}
+
+/*
+ * Sets the highlight of the chars in [at, at + n) that fall in [from, to),
+ * hl holds the highlight of [from, to) and can be NULL.
+ */
+void editorLexFill(unsigned char *hl, int from, int to, int at, int n, int cls) {
+	if (hl == NULL) return;
+	int end = at + n;
+	if (at < from) at = from;
+	if (end > to) end = to;
+	if (at < end) memset(&hl[at - from], cls, end - at);
+}
+
+/*
+ * Runs the highlighter on s (len chars), from position i with the state st,
+ * up to the first token boundary at or after stop. The highlight of the
+ * chars in [from, to) is written to hl[0 .. to - from), the caller clears it
+ * to HL_NORMAL first. Returns the position reached, st is updated to it.
+ */
+int editorLex(char *s, int len, int i, int stop, hlState *st, unsigned char *hl, int from, int to) {
+	char *scs = E.syntax->singleline_comment_start;
+	char *mcs = E.syntax->multiline_comment_start;
+	char *mce = E.syntax->multiline_comment_end;
+
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+
+	if (stop > len) stop = len;
+	if (st->in_line_comment) {
+		editorLexFill(hl, from, to, i, len - i, HL_COMMENT);
+		return len;
+	}
+
+	while (i < stop) {
+		char c = s[i];
+
+		if (scs_len && !st->in_string && !st->in_comment) {
+			if (c == scs[0] && !strncmp(&s[i], scs, scs_len)) {
+				editorLexFill(hl, from, to, i, len - i, HL_COMMENT);
+				st->in_line_comment = 1;
+				st->prev_hl = HL_COMMENT;
+				return len;
+			}
+		}
+
+		if (mcs_len && mce_len && !st->in_string) {
+			if (st->in_comment) {
+				st->prev_hl = HL_MLCOMMENT;
+				editorLexFill(hl, from, to, i, 1, HL_MLCOMMENT);
+				if (c == mce[0] && !strncmp(&s[i], mce, mce_len)) {
+					editorLexFill(hl, from, to, i, mce_len, HL_MLCOMMENT);
+					i += mce_len;
+					st->in_comment = 0;
+					st->prev_sep = 1;
+					continue;
+				} else {
+					i++;
+					continue;
+				}
+			} else if (c == mcs[0] && !strncmp(&s[i], mcs, mcs_len)) {
+				st->prev_hl = HL_MLCOMMENT;
+				editorLexFill(hl, from, to, i, mcs_len, HL_MLCOMMENT);
+				i += mcs_len;
+				st->in_comment = 1;
+				continue;
+			}
+		}
+
+
+		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+			if (st->in_string) {
+				st->prev_hl = HL_STRING;
+				editorLexFill(hl, from, to, i, 1, HL_STRING);
+				if (c == '\\' && i + 1 < len) {
+					editorLexFill(hl, from, to, i + 1, 1, HL_STRING);
+					i += 2;
+					continue;
+				}
+				if (c == st->in_string) st->in_string = 0; //in_string is equal to " or ', so, if it's a match, it's a closing quote 
+				i++;
+				st->prev_sep = 1;
+				continue;
+			}
+			else {
+				if (c == '"' || c == '\'') {
+					st->in_string = c;
+					st->prev_hl = HL_STRING;
+					editorLexFill(hl, from, to, i, 1, HL_STRING);
+					i++;
+					continue;
+				}
+			}
+		}
+
+		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+			//TODO: maybe use a regular expression instead of this?
+			if ((isdigit(c) && (st->prev_sep || st->prev_hl == HL_NUMBER)) ||
+				(c == '.' && st->prev_hl == HL_NUMBER)) {
+				editorLexFill(hl, from, to, i, 1, HL_NUMBER);
+				st->prev_hl = HL_NUMBER;
+				i++;
+				st->prev_sep = 0; 
+				continue;
+			}
+		}
+
+		if (st->prev_sep && !is_separator(c)) { // a word starts: one lookup in the keywords
+			int klen = 1;
+			while (i + klen < len && !is_separator(s[i + klen])) klen++;
+			char *keyword = editorSyntaxKeyword(E.syntax, &s[i], klen);
+			if (keyword != NULL) {
+				st->prev_hl = keyword[klen] == '|' ? HL_KEYWORD2 : HL_KEYWORD1;
+				editorLexFill(hl, from, to, i, klen, st->prev_hl);
+				i += klen;
+				st->prev_sep = 0;
+				continue;
+			}
+		}
+
+
+		st->prev_sep = is_separator(c); 
+		st->prev_hl = HL_NORMAL;
+		i++;
+	}
+	return i;
+}
+
+/*
+ * Rows longer than KILO_LONG_LINE never get a full render and highlight:
+ * only a window around what is on screen is expanded and highlighted, when
+ * it is drawn. To highlight the window correctly without starting from the
+ * beginning of the row, the highlighter state is saved every
+ * KILO_LONG_CHUNK chars, the first time the highlighter gets there.
+ * An edit keeps the checkpoints after it, moved with their chars, but
+ * they are not sure anymore: the highlighter goes on from the edit until
+ * its state is the one of an old checkpoint at the same place, from there
+ * on the highlight is the same as before the edit.
+ */
+
+/*
+ * Index of the last checkpoint at or before cx, adding checkpoints up to it
+ */
+int editorLongCheckpoint(erow *row, int cx) {
+	longRow *ll = row->ll;
+	if (E.syntax == NULL) return 0; // nothing to resume, the start state holds everywhere
+
+	for (;;) {
+		hlCheckpoint c = ll->checks[ll->nsure - 1];
+		hlCheckpoint *old = ll->nsure < ll->nchecks ? &ll->checks[ll->nsure] : NULL;
+		if (c.cx + KILO_LONG_CHUNK > cx && (old == NULL || old->cx > cx)) break;
+
+		int stop = c.cx + KILO_LONG_CHUNK;
+		if (old && old->cx < stop) stop = old->cx;
+		c.cx = editorLex(row->chars, row->size, c.cx, stop, &c.st, NULL, 0, 0);
+		c.edited = 0;
+		if (old && c.cx == old->cx && memcmp(&c.st, &old->st, sizeof(hlState)) == 0) {
+			// the same as before the edit, up to the next one
+			old->edited = 0;
+			do ll->nsure++; while (ll->nsure < ll->nchecks && !ll->checks[ll->nsure].edited);
+			continue;
+		}
+
+		// the old checkpoints it went past are of no use
+		int k = ll->nsure;
+		while (k < ll->nchecks && ll->checks[k].cx <= c.cx) k++;
+		if (c.cx >= row->size) {
+			ll->nchecks = ll->nsure;
+			break;
+		}
+		if (k == ll->nsure && ll->nchecks == ll->capchecks) {
+			ll->capchecks *= 2;
+			ll->checks = rsRealloc(ll->checks, sizeof(hlCheckpoint) * ll->capchecks, MEM_INDEX);
+		}
+		memmove(&ll->checks[ll->nsure + 1], &ll->checks[k], sizeof(hlCheckpoint) * (ll->nchecks - k));
+		ll->nchecks += ll->nsure + 1 - k;
+		ll->checks[ll->nsure++] = c;
+	}
+
+	int lo = 0, hi = ll->nsure;
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		if (ll->checks[mid].cx <= cx) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Called before removed chars at cx are replaced by added ones: forgets what
+ * was computed from them, and moves the checkpoints after them. Chars past
+ * the end of the row are gone.
+ */
+void editorLongInvalidate(erow *row, int cx, int removed, int added) {
+	longRow *ll = row->ll;
+	if (ll == NULL) return;
+
+	int lo = 1;
+	while (lo < ll->nchecks && ll->checks[lo].cx < cx - KILO_LONG_LOOKAHEAD) lo++; // a token ending before cx may have looked at it
+	if (ll->nsure > lo) ll->nsure = lo;
+
+	int n = lo;
+	for (int j = lo; j < ll->nchecks; j++) {
+		hlCheckpoint c = ll->checks[j];
+		if (c.cx < cx + removed || c.cx >= row->size) continue;
+		c.cx += added - removed;
+		if (n == lo) c.edited = 1;
+		ll->checks[n++] = c;
+	}
+	ll->nchecks = n;
+	ll->end_valid = 0;
+	ll->win_valid = 0;
+}
+
+hlState editorLongEndState(erow *row) {
+	longRow *ll = row->ll;
+	if (!ll->end_valid) {
+		int i = editorLongCheckpoint(row, row->size); // it may move the checkpoints
+		hlCheckpoint c = ll->checks[i];
+		if (E.syntax) editorLex(row->chars, row->size, c.cx, row->size, &c.st, NULL, 0, 0);
+		ll->end = c.st;
+		ll->end_valid = 1;
+	}
+	return ll->end;
+}
+
+/*
+ * Highlight of the chars in [cx0, cx1), resuming from the closest checkpoint
+ */
+void editorLongLex(erow *row, int cx0, int cx1, unsigned char *hl) {
+	memset(hl, HL_NORMAL, cx1 - cx0);
+	if (E.syntax == NULL) return;
+
+	int i = editorLongCheckpoint(row, cx0); // it may move the checkpoints
+	hlCheckpoint c = row->ll->checks[i];
+	editorLex(row->chars, row->size, c.cx, cx1, &c.st, hl, cx0, cx1);
+}
+
+/*
+ * Whether a multiline comment is still open at the end of the row. Long rows
+ * only find out when someone asks, since it takes a pass over the whole row.
+ */
+int editorRowOpenComment(erow *row) {
+	if (row->ll && !row->ll->end_valid) {
+		row->hl_open_comment = editorLongEndState(row).in_comment;
+	}
+	return row->hl_open_comment;
+}
+
+/*
+ * State of the highlighter at the beginning of the row
+ */
+hlState editorRowStartState(erow *row) {
+	hlState st;
+	st.in_string = 0;
+	st.in_comment = (row->idx > 0 && editorRowOpenComment(&E.row[row->idx - 1])); //inside a MULTILINE comment
+	st.in_line_comment = 0;
+	st.prev_sep = 1; // initialized to true because the beginning of the line is a separator
+	st.prev_hl = HL_NORMAL;
+	return st;
+}
+
+/*
+ * Called instead of the full highlighting on long rows: the checkpoints
+ * are not sure anymore if the state at the beginning of the row changed,
+ * the window is rebuilt when drawn. The end state is left to whoever needs it.
+ */
+void editorUpdateLongSyntax(erow *row) {
+	longRow *ll = row->ll;
+	hlState st = editorRowStartState(row);
+
+	if (ll->checks[0].st.in_comment != st.in_comment) {
+		ll->nsure = 1;
+		ll->end_valid = 0;
+	}
+	ll->checks[0].st = st;
+	ll->win_valid = 0;
+}
+
+void editorUpdateSyntax(erow *row) {
+	// a change of the open comment state cascades to the next rows: a loop, not
+	// a recursion, as an unclosed comment on top of a huge file reaches every row
+	for (;;) {
+		int in_comment;
+		if (row->idx == E.hl_stale) E.hl_stale = -1; // its start state is found out below
+		if (row->ll) {
+			editorUpdateLongSyntax(row);
+			if (!row->ll->end_valid && row->idx + 1 < E.numrows) {
+				// a keystroke should not cost a pass over the row
+				editorHlStale(row->idx + 1);
+				return;
+			}
+			in_comment = row->ll->end_valid ? row->ll->end.in_comment : row->hl_open_comment;
+		} else {
+			unsigned char *hl = editorHlScratch(row->rsize);
+			memset(hl, HL_NORMAL, row->rsize);
+
+			if (E.syntax == NULL) { // no syntax no party
+				editorRowSetSpans(row, hl, 0, row->rsize);
+				return;
+			}
+
+			hlState st = editorRowStartState(row);
+			editorLex(row->render, row->rsize, 0, row->rsize, &st, hl, 0, row->rsize);
+			editorRowSetSpans(row, hl, 0, row->rsize);
+			in_comment = st.in_comment;
+		}
+
+		int changed = (row->hl_open_comment != in_comment);
+		row->hl_open_comment = in_comment;
+		if (!changed || row->idx + 1 >= E.numrows) return;
+		row = &E.row[row->idx + 1];
+	}
+}
+
+/*
+ * Rows opened from an index cache have their open comment state but no
+ * spans: they are highlighted the first time they are drawn. So is a stale
+ * row before it, see editorHlStale.
+ */
+void editorRowHighlight(erow *row) {
+	editorHlResolve(row->idx);
+	if (row->nhl >= 0) return;
+	row->nhl = 0;
+	editorUpdateSyntax(row);
+}
+
+/*
+ * The rows after a long row whose end state is not known yet keep the
+ * highlight of its old end state: they are highlighted again when a row from
+ * there on is needed, computing the end state then. The row is E.hl_stale.
+ */
+void editorHlStale(int at) {
+	while (E.hl_stale >= 0 && E.hl_stale != at) editorHlResolve(E.hl_stale);
+	E.hl_stale = at;
+}
+
+/*
+ * Highlights again the stale rows at or before the row at
+ */
+void editorHlResolve(int at) {
+	while (E.hl_stale >= 0 && E.hl_stale <= at) editorUpdateSyntax(&E.row[E.hl_stale]);
+}
+
+int editorSyntaxToColor(int hl) {
+	switch(hl) {
+		case HL_NUMBER: return 196;
+		case HL_STRING: return 5;
+		case HL_MATCH: return 27;
+		case HL_MLCOMMENT:
+		case HL_COMMENT: return 6;
+		case HL_KEYWORD1: return 11;
+		case HL_KEYWORD2: return 10;
+		
+
+		default: return 37;
+	}
+}
+
+void editorSelectSyntaxHighlight() {
+	E.syntax = NULL;
+	if (E.filename == NULL) return;
+	if (ST.image == NULL) editorSyntaxInit(NULL); // the built in syntaxes only
+
+	// the file extension is one lookup, the other patterns can be anywhere
+	// in the filename
+	syntaxHeader *h = (syntaxHeader *)ST.image;
+	char *ext = strrchr(E.filename, '.');
+	if (ext) {
+		uint32_t *slot = syntaxProbe(ST.image, (uint32_t *)(ST.image + h->exts),
+			h->extmask, 2, ext, strlen(ext));
+		if (*slot) E.syntax = &ST.syntaxes[slot[1]];
+	}
+	uint32_t *patterns = (uint32_t *)(ST.image + h->patterns);
+	for (uint32_t j = 0; E.syntax == NULL && j < h->npatterns; j++) {
+		if (strstr(E.filename, ST.image + patterns[2 * j]))
+			E.syntax = &ST.syntaxes[patterns[2 * j + 1]];
+	}
+	if (E.syntax == NULL) return;
+
+	int filerow;
+	for(filerow = 0; filerow < E.numrows; filerow++) {
+		editorUpdateSyntax(&E.row[filerow]);
+	}
+}
+
+/*** row operations ***/
+
+/*
+ * Whether the len bytes at s are all ASCII. Most rows are, and never get
+ * decoded: the bytes are or-ed together 16 at a time, then 8.
+ */
+int editorIsAscii(const char *s, int len) {
+	int j = 0;
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	for (; j + 16 <= len; j += 16) acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&s[j]));
+	if (_mm_movemask_epi8(acc)) return 0;
+#endif
+	for (; j + 8 <= len; j += 8) {
+		uint64_t w;
+		memcpy(&w, &s[j], 8);
+		if (w & 0x8080808080808080ULL) return 0;
+	}
+	unsigned char tail = 0;
+	for (; j < len; j++) tail |= s[j];
+	return tail < 0x80;
+}
+
+/*
+ * Decodes the UTF-8 sequence at s, len bytes at most, into *cp. Returns its
+ * length, 0 if s does not start a valid one: overlong forms and surrogates
+ * are not valid.
+ */
+int utf8Decode(const char *s, int len, unsigned *cp) {
+	const unsigned char *u = (const unsigned char *)s;
+	unsigned c, min;
+	int n;
+	if (u[0] < 0x80) {
+		*cp = u[0];
+		return 1;
+	}
+	if (u[0] >= 0xc2 && u[0] < 0xe0) n = 2, c = u[0] & 0x1f, min = 0x80;
+	else if (u[0] >= 0xe0 && u[0] < 0xf0) n = 3, c = u[0] & 0x0f, min = 0x800;
+	else if (u[0] >= 0xf0 && u[0] < 0xf5) n = 4, c = u[0] & 0x07, min = 0x10000;
+	else return 0;
+	if (len < n) return 0;
+	for (int j = 1; j < n; j++) {
+		if ((u[j] & 0xc0) != 0x80) return 0;
+		c = (c << 6) | (u[j] & 0x3f);
+	}
+	if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) return 0;
+	*cp = c;
+	return n;
+}
+
+/*
+ * Screen columns of the char at s, -1 if it can't be printed as it is: a
+ * control char, a byte that is not valid UTF-8 or a char the locale does
+ * not know. Its length in bytes goes to clen.
+ */
+int editorCharWidth(const char *s, int len, int *clen) {
+	unsigned cp;
+	*clen = utf8Decode(s, len, &cp);
+	if (*clen == 0) {
+		*clen = 1;
+		return -1;
+	}
+	return wcwidth(cp);
+}
+
+// the colmarks of a row are in the buffer of its marks, after them
+colmark *editorRowCols(erow *row) {
+	return (colmark *)(row->marks + row->nmarks);
+}
+
+/*
+ * Number of colmarks starting before rx (by_col == 0) or at or before col (by_col == 1)
+ */
+int editorRowColsBefore(erow *row, int pos, int by_col) {
+	colmark *cols = editorRowCols(row);
+	int lo = 0, hi = row->ncols;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (by_col ? cols[mid].col <= pos : cols[mid].rx < pos) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Render index to screen column. They are the same in ASCII rows, the ones
+ * without colmarks.
+ */
+int editorRowRxToCol(erow *row, int rx) {
+	int k = editorRowColsBefore(row, rx, 0);
+	if (k == 0) return rx;
+
+	colmark *m = &editorRowCols(row)[k - 1];
+	if (rx < m->rx + m->len) return m->col;
+	return m->col + m->width + (rx - m->rx - m->len);
+}
+
+/*
+ * Screen column to render index, of the char that takes the column
+ */
+int editorRowColToRx(erow *row, int col) {
+	int k = editorRowColsBefore(row, col, 1);
+	if (k == 0) return col;
+
+	colmark *m = &editorRowCols(row)[k - 1];
+	int end_col = m->col + m->width;
+	if (col < end_col) return m->rx;
+	return m->rx + m->len + (col - end_col);
+}
+
+/*
+ * Width in render columns of the tab a mark points to. Tab stops are screen
+ * columns, that are not render ones after a multibyte char.
+ */
+int editorMarkWidth(erow *row, rxmark *m) {
+	int col = row->ncols ? editorRowRxToCol(row, m->rx) : m->rx;
+	return KILO_TAB_STOP - (col % KILO_TAB_STOP);
+}
+
+/*
+ * Number of marks starting before cx (by_rx == 0) or at or before rx (by_rx == 1)
+ */
+int editorRowMarksBefore(erow *row, int pos, int by_rx) {
+	int lo = 0, hi = row->nmarks;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (by_rx ? row->marks[mid].rx <= pos : row->marks[mid].cx < pos) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Character index to render index
+ */
+int editorRowCxToRx(erow *row, int cx) {
+	int k = editorRowMarksBefore(row, cx, 0);
+	if (k == 0) return cx;
+
+	rxmark *m = &row->marks[k - 1];
+	return m->rx + editorMarkWidth(row, m) + (cx - m->cx - 1);
+}
+
+/*
+ * Render index to character indes
+ */
+int editorRowRxToCx(erow *row, int rx) {
+	int k = editorRowMarksBefore(row, rx, 1);
+	int cx = rx;
+	if (k > 0) {
+		rxmark *m = &row->marks[k - 1];
+		int end_rx = m->rx + editorMarkWidth(row, m);
+		if (rx < end_rx) return m->cx;
+		cx = m->cx + 1 + (rx - end_rx);
+	}
+	return cx < row->size ? cx : row->size;
+}
+
+/*
+ * The char after the one at cx, for the cursor: the bytes of a UTF-8
+ * sequence and the zero width chars that follow it go together
+ */
+int editorRowNextChar(erow *row, int cx) {
+	if (cx >= row->size) return row->size;
+	if (row->ncols == 0) return cx + 1;
+	int len;
+	editorCharWidth(&row->chars[cx], row->size - cx, &len);
+	cx += len;
+	while (cx < row->size && (unsigned char)row->chars[cx] >= 0x80 &&
+		editorCharWidth(&row->chars[cx], row->size - cx, &len) == 0) cx += len;
+	return cx;
+}
+
+int editorRowPrevChar(erow *row, int cx) {
+	if (cx <= 0) return 0;
+	if (row->ncols == 0) return cx - 1;
+	return editorRowCharStart(row, cx - 1);
+}
+
+// start of the UTF-8 sequence that has the byte at cx
+int utf8Start(erow *row, int cx) {
+	int j = cx;
+	while (j > 0 && cx - j < 3 && ((unsigned char)row->chars[j] & 0xc0) == 0x80) j--;
+	unsigned cp;
+	return j + utf8Decode(&row->chars[j], row->size - j, &cp) > cx ? j : cx;
+}
+
+// start of the char that has the byte at cx, zero width chars belong to the one before them
+int editorRowCharStart(erow *row, int cx) {
+	if (row->ncols == 0 || cx <= 0 || cx >= row->size) return cx;
+	int len;
+	cx = utf8Start(row, cx);
+	while (cx > 0 && (unsigned char)row->chars[cx] >= 0x80 &&
+		editorCharWidth(&row->chars[cx], row->size - cx, &len) == 0) cx = utf8Start(row, cx - 1);
+	return cx;
+}
+
+/*
+ * render is a separate buffer only when the row has something to expand,
+ * otherwise it points to chars and must not be freed on its own.
+ */
+void editorRowFreeRender(erow *row) {
+	if (row->render != row->chars) rsFree(row->render, MEM_RENDER);
+	row->render = NULL;
+}
+
+void editorLongFree(erow *row) {
+	if (row->ll == NULL) return;
+	rsFree(row->ll->checks, MEM_INDEX);
+	rsFree(row->ll, MEM_INDEX);
+	row->ll = NULL;
+}
+
+/*
+ * Makes sure the window of a long row covers the render chars [rx, rx + len),
+ * expanding and highlighting it again with some margin when it does not.
+ */
+void editorLongWindow(erow *row, int rx, int len) {
+	longRow *ll = row->ll;
+	if (ll->win_valid && ll->roff <= rx && 
+		(rx + len <= ll->roff + row->rsize || ll->cx1 == row->size)) return;
+
+	int cx0 = editorRowRxToCx(row, rx > KILO_LONG_MARGIN ? rx - KILO_LONG_MARGIN : 0);
+	int cx1 = editorRowRxToCx(row, rx + len + KILO_LONG_MARGIN) + 1;
+	if (cx1 > row->size) cx1 = row->size;
+	int tabs = editorRowMarksBefore(row, cx1, 0) - editorRowMarksBefore(row, cx0, 0);
+
+	editorRowFreeRender(row);
+	row->render = rsAlloc(cx1 - cx0 + tabs*(KILO_TAB_STOP - 1) + 1, MEM_RENDER);
+	ll->roff = editorRowCxToRx(row, cx0);
+
+	unsigned char *chl = malloc(cx1 - cx0 + 1); // highlight of the chars
+	if (chl == NULL) die("malloc");
+	editorLongLex(row, cx0, cx1, chl);
+	unsigned char *hl = editorHlScratch(cx1 - cx0 + tabs*(KILO_TAB_STOP - 1));
+
+	int idx = 0, t = editorRowMarksBefore(row, cx0, 0);
+	for (int j = cx0; j < cx1; j++) {
+		if (row->chars[j] == '\t') {
+			int w = editorMarkWidth(row, &row->marks[t++]);
+			memset(&hl[idx], chl[j - cx0], w);
+			memset(&row->render[idx], ' ', w);
+			idx += w;
+		}
+		else {
+			hl[idx] = chl[j - cx0];
+			row->render[idx++] = row->chars[j];
+		}
+	}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+	editorRowSetSpans(row, hl, ll->roff, row->rsize);
+	free(chl);
+
+	ll->cx0 = cx0;
+	ll->cx1 = cx1;
+	ll->win_valid = 1;
+}
+
+/*
+ * The marks of a row with bytes above 127: its tabs, whose width depends on
+ * the chars before them, and a colmark for every char that is not ASCII.
+ */
+void editorRowMarkUtf8(erow *row, int tabs) {
+	int ncols = 0, len;
+	unsigned cp;
+	for (int j = 0; j < row->size; j += len) {
+		len = 1;
+		if ((unsigned char)row->chars[j] >= 0x80) {
+			len = utf8Decode(&row->chars[j], row->size - j, &cp);
+			if (len == 0) len = 1;
+			ncols++;
+		}
+	}
+	row->marks = rsAlloc(sizeof(rxmark) * tabs + sizeof(colmark) * ncols, MEM_INDEX);
+	colmark *cols = (colmark *)(row->marks + tabs);
+
+	int rx = 0, col = 0;
+	for (int j = 0; j < row->size; j += len) {
+		unsigned char c = row->chars[j];
+		len = 1;
+		if (c == '\t') {
+			row->marks[row->nmarks].cx = j;
+			row->marks[row->nmarks].rx = rx;
+			row->nmarks++;
+			int w = KILO_TAB_STOP - (col % KILO_TAB_STOP);
+			rx += w;
+			col += w;
+		} else if (c < 0x80) {
+			rx++;
+			col++;
+		} else {
+			int w = editorCharWidth(&row->chars[j], row->size - j, &len);
+			if (w < 0) w = 1; // drawn as a '?'
+			cols[row->ncols].rx = rx;
+			cols[row->ncols].col = col;
+			cols[row->ncols].len = len;
+			cols[row->ncols].width = w;
+			row->ncols++;
+			rx += len;
+			col += w;
+		}
+	}
+}
+
+void editorUpdateRow(erow *row) {
+	editorIndexRow(row);
+
+	int tabs = 0;
+	char *tab = row->chars;
+	while ((tab = memchr(tab, '\t', row->size - (tab - row->chars)))) {
+		tabs++;
+		tab++;
+	}
+
+	editorRowFreeRender(row);
+	rsFree(row->marks, MEM_INDEX);
+	row->marks = NULL;
+	row->nmarks = 0;
+	row->ncols = 0;
+	if (!editorIsAscii(row->chars, row->size)) {
+		editorRowMarkUtf8(row, tabs);
+	} else if (tabs) {
+		row->marks = rsAlloc(sizeof(rxmark) * tabs, MEM_INDEX);
+		int rx = 0, j = 0;
+		while ((tab = memchr(&row->chars[j], '\t', row->size - j))) {
+			rx += (tab - row->chars) - j;
+			j = tab - row->chars;
+			row->marks[row->nmarks].cx = j;
+			row->marks[row->nmarks].rx = rx;
+			row->nmarks++;
+			rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+			j++;
+		}
+	}
+
+	if (row->size > KILO_LONG_LINE) {
+		// the window is expanded when the row is drawn
+		if (row->ll == NULL) {
+			row->ll = rsAlloc(sizeof(longRow), MEM_INDEX);
+			memset(row->ll, 0, sizeof(longRow));
+			row->ll->capchecks = 16;
+			row->ll->checks = rsAlloc(sizeof(hlCheckpoint) * row->ll->capchecks, MEM_INDEX);
+			row->ll->checks[0].cx = 0;
+			row->ll->checks[0].st = editorRowStartState(row);
+			row->ll->nchecks = 1;
+			row->ll->nsure = 1;
+		}
+		editorLongInvalidate(row, row->size, 0, 0); // the row may have been cut
+		row->rsize = 0;
+		editorUpdateSyntax(row);
+		return;
+	}
+	editorLongFree(row);
+
+	if (tabs == 0) {
+		row->render = row->chars;
+		row->rsize = row->size;
+		editorUpdateSyntax(row);
+		return;
+	}
+	row->render = rsAlloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1, MEM_RENDER);
+
+	int idx = 0, t = 0;
+	for (int j = 0; j < row->size; j++) {
+		if (row->chars[j] == '\t') {
+			int w = editorMarkWidth(row, &row->marks[t++]);
+			memset(&row->render[idx], ' ', w);
+			idx += w;
+		}
 		else {
 			row->render[idx++] = row->chars[j];
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	row->render[idx] = '\0';
+	row->rsize = idx;
+
+	editorUpdateSyntax(row);
+}
+
+
+void editorRowInit(erow *row, int at, const char *s, size_t len) {
+	row->idx = at;
+	row->size = len;
+	row->chars = rsAlloc(len + 1, MEM_CHARS);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->nhl = 0;
+	row->marks = NULL;
+	row->nmarks = 0;
+	row->ncols = 0;
+	row->hl_open_comment = 0;
+	row->ll = NULL;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+	if (at < 0 || at > E.numrows) return;
+	editorIndexFrom(at);
+	if (E.hl_stale >= at) editorHlResolve(E.hl_stale); // known by its index
+
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+	
+	editorRowInit(&E.row[at], at, s, len);
+	// the next row was highlighted after the previous one: a change from there goes on to it
+	if (at > 0) E.row[at].hl_open_comment = E.row[at - 1].hl_open_comment;
+	editorUpdateRow(&E.row[at]);
+
+	E.numrows++;
+	E.dirty++;
+}
+
+/*
+ * Inserts a row for every line of s, lines are separated by '\n'. The row
+ * table moves once, however many rows there are.
+ */
+void editorInsertRows(int at, const char *s, size_t len) {
+	if (at < 0 || at > E.numrows) return;
+	editorIndexFrom(at);
+	if (E.hl_stale >= at) editorHlResolve(E.hl_stale); // known by its index
+
+	int n = 1;
+	for (const char *p = s; (p = memchr(p, '\n', len - (p - s))); p++) n++;
+
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+	if (E.row == NULL) die("realloc");
+	memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+	for (int j = at + n; j < E.numrows + n; j++) E.row[j].idx += n;
+	E.numrows += n;
+
+	const char *line = s;
+	for (int j = at; j < at + n; j++) {
+		const char *nl = memchr(line, '\n', len - (line - s));
+		size_t linelen = nl ? (size_t)(nl - line) : len - (line - s);
+		editorRowInit(&E.row[j], j, line, linelen);
+		if (at > 0) E.row[j].hl_open_comment = E.row[at - 1].hl_open_comment; // as in editorInsertRow
+		line += linelen + 1;
+	}
+	// all the rows exist before the first is highlighted: its comments may reach the others
+	for (int j = at; j < at + n; j++) editorUpdateRow(&E.row[j]);
+	E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+	editorRowFreeRender(row);
+	rsFree(row->chars, MEM_CHARS);
+	rsFree(row->hl, MEM_HL);
+	rsFree(row->marks, MEM_INDEX);
+	editorLongFree(row);
+}
+
+void editorDelRows(int at, int n) {
+	if (at < 0 || n <= 0 || at + n > E.numrows) return;
+	editorIndexFrom(at);
+	if (E.hl_stale >= at) editorHlResolve(E.hl_stale); // known by its index
+	for (int j = at; j < at + n; j++) editorFreeRow(&E.row[j]);
+	memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+	E.numrows -= n;
+	for (int j = at; j < E.numrows; j++) E.row[j].idx -= n;
+	E.dirty++;
+}
+
+void editorDelRow(int at) {
+	editorDelRows(at, 1);
+}
+
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+	if (at < 0 || at > row->size) at = row->size;	
+	editorRowFreeRender(row); // it may point to the chars we are about to move
+	editorLongInvalidate(row, at, 0, len);
+	row->chars = rsRealloc(row->chars, row->size + len + 1, MEM_CHARS); // add one, because the actual length of the buffer (NOT the size value) 
+													 //	also includes the null byte to terminate the string			
+	memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1); // memmove must be used insted of memcpy if the memory area overlap
+	memcpy(&row->chars[at], s, len);
+	row->size += len;
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+	char ch = c;
+	editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+	editorRowFreeRender(row);
+	editorLongInvalidate(row, row->size, 0, len);
+	row->chars = rsRealloc(row->chars, row->size +len + 1, MEM_CHARS);
+	memcpy(&row->chars[row->size], s, len);
+	row->size += len;
+	row->chars[row->size] = '\0';
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowDeleteChar(erow *row, int at) {
+	if (at < 0 || at >= row->size) return;
+	editorLongInvalidate(row, at, 1, 0);
+	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+	row->size--;
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+/*** line index ***/
+
+/*
+ * Row sizes change one at a time and are updated in place. Rows inserted
+ * or deleted move all the ones after them, whose nodes are then rebuilt
+ * in linear time, and only as far as the offsets asked for go: the one of
+ * the cursor, after an edit at the cursor, costs next to nothing.
+ */
+
+struct lineIndex LX = {NULL, 0, 0};
+
+// rows from at on are moving
+void editorIndexFrom(int at) {
+	if (at < LX.valid) LX.valid = at;
+}
+
+// bytes of the row of node i, as the tree has them
+long long indexLeaf(int i) {
+	long long v = LX.tree[i];
+	for (int j = i - 1; j > i - (i & -i); j -= j & -j) v -= LX.tree[j];
+	return v;
+}
+
+// the size of the row may have changed
+void editorIndexRow(erow *row) {
+	int i = row->idx + 1;
+	if (i > LX.valid) return;
+	long long d = row->size + 1 - indexLeaf(i);
+	if (d == 0) return;
+	for (; i <= LX.valid; i += i & -i) LX.tree[i] += d;
+}
+
+// makes the nodes up to n right, and only those
+void editorIndexBuild(int n) {
+	if (n > E.numrows) n = E.numrows;
+	if (LX.valid >= n) return;
+	if (E.numrows + 1 > LX.cap) {
+		while (E.numrows + 1 > LX.cap) LX.cap = LX.cap ? LX.cap * 2 : 1024;
+		LX.tree = rsRealloc(LX.tree, sizeof(long long) * LX.cap, MEM_INDEX);
+	}
+	for (int i = LX.valid + 1; i <= n; i++) LX.tree[i] = E.row[i - 1].size + 1;
+	// every node adds itself to its parent: among the nodes kept only those of
+	// the prefix of LX.valid have a parent to rebuild
+	for (int i = LX.valid; i > 0; i -= i & -i)
+		if (i + (i & -i) <= n) LX.tree[i + (i & -i)] += LX.tree[i];
+	for (int i = LX.valid + 1; i <= n; i++)
+		if (i + (i & -i) <= n) LX.tree[i + (i & -i)] += LX.tree[i];
+	LX.valid = n;
+}
+
+// bytes of the file before row y
+long long editorRowOffset(int y) {
+	editorIndexBuild(y);
+	if (y > E.numrows) y = E.numrows;
+	long long off = 0;
+	for (int i = y; i > 0; i -= i & -i) off += LX.tree[i];
+	return off;
+}
+
+// the row that has the byte at offset off, the last row past the end
+int editorOffsetRow(long long off) {
+	editorIndexBuild(E.numrows);
+	int y = 0, step = 1;
+	while (step <= E.numrows / 2) step *= 2;
+	for (; step; step /= 2) {
+		if (y + step <= E.numrows && LX.tree[y + step] <= off) {
+			y += step;
+			off -= LX.tree[y];
+		}
+	}
+	return y < E.numrows ? y : E.numrows - 1;
+}
+
+/*
+ * Ctrl-G: goes to a line, "line:col", a byte offset, "@4096" or "@0x1000",
+ * or a point of the file, "50%"
+ */
+void editorGoto() {
+	char *where = editorPrompt("Go to: %s (line[:col], @byte, N%%, ESC to cancel)", NULL);
+	if (where == NULL) return;
+
+	char *s = where + strspn(where, " "), *end;
+	char *num = s; // where the last number starts: no digits there is no place
+	long long y, x = 0;
+	int len = strlen(s);
+	if (s[0] == '@' || (len && s[len - 1] == '%')) {
+		long long off;
+		if (s[0] == '@') {
+			num = s + 1;
+			off = strtoll(num, &end, 0);
+		} else {
+			off = strtod(s, &end) / 100 * editorRowOffset(E.numrows);
+			if (end != s && end == s + len - 1) end++;
+		}
+		if (off < 0) off = 0;
+		y = editorOffsetRow(off);
+		if (y >= 0) x = off - editorRowOffset(y);
+	} else {
+		y = strtoll(s, &end, 10) - 1;
+		if (*end == ':' && end != s) {
+			num = end + 1;
+			x = strtoll(num, &end, 10) - 1;
+		}
+	}
+	if (*end != '\0' || end == num) {
+		editorSetStatusMessage("Not a place to go to: %s", where);
+		free(where);
+		return;
+	}
+	free(where);
+
+	editorFilterEnd();
+	if (y >= E.numrows) y = E.numrows - 1;
+	if (y < 0) y = 0;
+	E.cy = y;
+	int size = E.cy < E.numrows ? E.row[E.cy].size : 0;
+	E.cx = x < 0 ? 0 : x > size ? size : x;
+	if (E.cy < E.numrows) E.cx = editorRowCharStart(&E.row[E.cy], E.cx);
+	E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+}
+
+/*** memory ***/
+
+/*
+ * Fills kinds, when not NULL, with the bytes of every kind of memory and
+ * returns their sum.
+ */
+size_t editorMemUsage(size_t *kinds) {
+	size_t k[MEM_KINDS];
+	memcpy(k, RS.kind_bytes, sizeof(k));
+	k[MEM_TABLE] = E.row ? malloc_usable_size(E.row) : 0;
+	k[MEM_SLACK] = RS.nslabs * RS_SLAB_SIZE - RS.used_bytes + RS.setcap * sizeof(uintptr_t);
+
+	size_t total = 0;
+	for (int j = 0; j < MEM_KINDS; j++) total += k[j];
+	if (kinds) memcpy(kinds, k, sizeof(k));
+	return total;
+}
+
+char *mem_names[MEM_KINDS] = {"table", "chars", "render", "hl", "search", "undo", "index", "slack"};
+
+int editorMemSize(char *buf, size_t len, size_t bytes) {
+	if (bytes < 10 * 1024) return snprintf(buf, len, "%zuB", bytes);
+	if (bytes < 1024 * 1024) return snprintf(buf, len, "%zuK", bytes / 1024);
+	return snprintf(buf, len, "%.1fM", bytes / (1024.0 * 1024));
+}
+
+/*
+ * One line with the memory of every kind in use, the memory per row and its
+ * ratio to the size of the file, and how fragmented the row slabs are.
+ */
+int editorMemStats(char *buf, size_t len) {
+	size_t k[MEM_KINDS];
+	size_t total = editorMemUsage(k);
+	size_t file = 0;
+	for (int j = 0; j < E.numrows; j++) file += E.row[j].size + 1;
+
+	int n = snprintf(buf, len, "mem ");
+	n += editorMemSize(buf + n, n < (int)len ? len - n : 0, total);
+	for (int j = 0; j < MEM_KINDS && n < (int)len; j++) {
+		if (k[j] == 0) continue;
+		n += snprintf(buf + n, len - n, " %s ", mem_names[j]);
+		if (n < (int)len) n += editorMemSize(buf + n, len - n, k[j]);
+	}
+	if (n < (int)len) {
+		n += snprintf(buf + n, len - n, " | %zu B/row %.1fx file",
+			E.numrows ? total / E.numrows : 0, file ? (double)total / file : 0);
+	}
+	if (n < (int)len) {
+		size_t mapped = RS.nslabs * RS_SLAB_SIZE;
+		n += snprintf(buf + n, len - n, " | %zu slabs %.1f%% frag %zu released", RS.nslabs,
+			mapped ? 100.0 * (mapped - RS.used_bytes) / mapped : 0, RS.released);
+	}
+	return n;
+}
+
+/*
+ * Gives back what can be rebuilt or is not used: the windows of the long
+ * rows that are not on screen, the highlight scratch buffer, the end of the
+ * row table left by deleted rows, and the slabs emptied by moving the
+ * buffers of the sparse ones.
+ */
+void editorMemReclaim() {
+	if (E.numrows) {
+		erow *row = realloc(E.row, sizeof(erow) * E.numrows);
+		if (row) E.row = row;
+	}
+
+	for (int j = 0; j < E.numrows; j++) {
+		erow *row = &E.row[j];
+		if (row->ll == NULL || (j >= E.rowoff && j < E.rowoff + E.screenrows)) continue;
+		editorRowFreeRender(row);
+		rsFree(row->hl, MEM_HL);
+		row->hl = NULL;
+		row->nhl = 0;
+		row->rsize = 0;
+		row->ll->win_valid = 0;
+	}
+
+	rsFree(hl_scratch, MEM_HL);
+	hl_scratch = NULL;
+	hl_scratch_cap = 0;
+
+	if (rsDrain() == 0) return;
+	for (int j = 0; j < E.numrows; j++) {
+		erow *row = &E.row[j];
+		char *chars = rsMove(row->chars, MEM_CHARS);
+		row->render = row->render == row->chars ? chars : rsMove(row->render, MEM_RENDER);
+		row->chars = chars;
+		row->hl = rsMove(row->hl, MEM_HL);
+		row->marks = rsMove(row->marks, MEM_INDEX);
+		if (row->ll) {
+			row->ll->checks = rsMove(row->ll->checks, MEM_INDEX);
+			row->ll = rsMove(row->ll, MEM_INDEX);
+		}
+	}
+	rsUndrain();
+}
+
+/*
+ * Reclaims memory when the usage goes over E.mem_budget. When reclaiming is
+ * not enough, it waits for the usage to grow by a sixteenth of the budget
+ * before trying again.
+ */
+void editorMemBudget() {
+	static size_t after = 0; // usage after the last reclaim
+	if (E.mem_budget == 0) return;
+
+	size_t total = editorMemUsage(NULL);
+	if (total <= E.mem_budget || total < after + E.mem_budget / 16) return;
+	editorMemReclaim();
+	after = editorMemUsage(NULL);
+	if (after > E.mem_budget)
+		editorSetStatusMessage("Over the memory budget: %zuMB in use", after >> 20);
+}
+
+/*** editor operations ***/
+void editorInsertChar(int c) {
+	if (editorReadOnly()) return;
+	if (E.cy == E.numrows) {
+		if (E.cy > 0) editorNoteInsert(E.cy - 1, E.row[E.cy - 1].size, "\n", 1);
+		editorInsertRow(E.numrows, "", 0);
+	}
+	char ch = c;
+	editorNoteInsert(E.cy, E.cx, &ch, 1);
+	editorRowInsertChar(&E.row[E.cy], E.cx, c);
+	E.cx++;
+}
+
+void editorInsertNewline() {
+	if (editorReadOnly()) return;
+	if (E.cy < E.numrows) editorNoteInsert(E.cy, E.cx, "\n", 1);
+	else if (E.cy > 0) editorNoteInsert(E.cy - 1, E.row[E.cy - 1].size, "\n", 1);
+
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	}
+	else {
+		erow *row = &E.row[E.cy];
+		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+		row = &E.row[E.cy];
+		row->size = E.cx;		
+		row->chars[row->size] = '\0';
+		editorUpdateRow(row);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+void editorDelChar() {
+	if (editorReadOnly()) return;
+	if (E.cy == E.numrows) return; // last line
+	if (E.cx == 0 && E.cy == 0) return; // beginning of the file
+
+	erow *row = &E.row[E.cy];
+	int prev = editorRowPrevChar(row, E.cx);
+	if (E.cx > 0 && prev < E.cx - 1) { // a UTF-8 char, maybe with combining marks
+		editorDeleteText(E.cy, prev, E.cx - prev);
+		E.cx = prev;
+	}
+	else if (E.cx > 0) {
+		editorNoteDelete(E.cy, E.cx - 1, 1);
+		editorRowDeleteChar(row, E.cx - 1);
+		E.cx--;
+	}
+	else {
+		editorNoteDelete(E.cy - 1, E.row[E.cy - 1].size, 1);
+		E.cx = E.row[E.cy - 1].size;
+		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+/*
+ * Text positions are (row, char) pairs. A '\n' in a text stands for the end
+ * of a row, so inserting one splits the row and deleting one joins two.
+ */
+
+/*
+ * End of the len bytes of text starting at (y, x). The text is clamped at
+ * the end of the file, the bytes it really has are returned.
+ */
+int editorTextEnd(int y, int x, int len, int *y2, int *x2) {
+	int left = len;
+	while (left > 0) {
+		int avail = E.row[y].size - x;
+		if (left <= avail) {
+			x += left;
+			left = 0;
+			break;
+		}
+		if (y + 1 == E.numrows) {
+			left -= avail;
+			x = E.row[y].size;
+			break;
+		}
+		left -= avail + 1;
+		y++;
+		x = 0;
+	}
+	*y2 = y;
+	*x2 = x;
+	return len - left;
+}
+
+// copies the len bytes of text starting at (y, x) to dst
+void editorTextCopy(int y, int x, int len, char *dst) {
+	while (len > 0 && y < E.numrows) {
+		int n = E.row[y].size - x;
+		if (n > len) n = len;
+		memcpy(dst, &E.row[y].chars[x], n);
+		dst += n;
+		len -= n;
+		if (len > 0) {
+			*dst++ = '\n';
+			len--;
+		}
+		y++;
+		x = 0;
+	}
+}
+
+/*
+ * Inserts len bytes of text at (y, x). However many rows the text has, the
+ * row table moves once: the cost is the size of the text.
+ */
+void editorInsertText(int y, int x, const char *s, int len) {
+	if (len <= 0 || y < 0 || y > E.numrows) return;
+	editorNoteInsert(y, x, s, len);
+	if (y == E.numrows) editorInsertRow(E.numrows, "", 0);
+
+	erow *row = &E.row[y];
+	if (x > row->size) x = row->size;
+	const char *nl = memchr(s, '\n', len);
+	if (nl == NULL) {
+		editorRowInsertString(row, x, s, len);
+		return;
+	}
+
+	// the lines after the first become rows, the end of the row goes after the last
+	int tail = row->size - x;
+	int restlen = len - (nl + 1 - s);
+	char *rest = malloc(restlen + tail);
+	if (rest == NULL) die("malloc");
+	memcpy(rest, nl + 1, restlen);
+	memcpy(rest + restlen, &row->chars[x], tail);
+	editorInsertRows(y + 1, rest, restlen + tail);
+	free(rest);
+
+	row = &E.row[y];
+	editorRowFreeRender(row);
+	editorLongInvalidate(row, x, row->size - x, 0);
+	row->size = x;
+	row->chars[x] = '\0';
+	editorRowAppendString(row, (char *)s, nl - s);
+}
+
+/*
+ * Deletes len bytes of text from (y, x), joining the rows it spans
+ */
+void editorDeleteText(int y, int x, int len) {
+	if (len <= 0 || y < 0 || y >= E.numrows) return;
+	erow *row = &E.row[y];
+	if (x > row->size) x = row->size;
+	int y2, x2;
+	len = editorTextEnd(y, x, len, &y2, &x2);
+	if (len == 0) return;
+	editorNoteDelete(y, x, len);
+
+	if (y2 > y && E.hl_stale > y) editorHlResolve(E.hl_stale); // before its index changes
+	erow *end = &E.row[y2];
+	int open = end->hl_open_comment;
+
+	editorRowFreeRender(row);
+	if (y2 == y) {
+		editorLongInvalidate(row, x, x2 - x, 0);
+		memmove(&row->chars[x], &row->chars[x2], row->size - x2 + 1);
+		row->size -= x2 - x;
+	} else {
+		int tail = end->size - x2;
+		editorLongInvalidate(row, x, row->size - x, tail);
+		row->chars = rsRealloc(row->chars, x + tail + 1, MEM_CHARS);
+		memcpy(&row->chars[x], &end->chars[x2], tail);
+		row->size = x + tail;
+		row->chars[row->size] = '\0';
+		editorDelRows(y + 1, y2 - y);
+		row = &E.row[y];
+		row->hl_open_comment = open; // the next row was highlighted after the last deleted one
+	}
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+/*** undo ***/
+
+/*
+ * The journal is a single buffer of records, oldest first. A record is an
+ * insert or a delete of some text at a position, with the text right after
+ * it. Typing and backspacing extend the last record instead of adding one,
+ * and the records of a group are undone and redone together. The records
+ * after pos are the undone ones, waiting for a redo. When the journal grows
+ * over its limit the oldest groups are dropped.
+ */
+
+struct undoJournal UJ;
+
+undoRecord *undoAt(size_t off) {
+	return (undoRecord *)(UJ.buf + off);
+}
+
+size_t undoSize(int len) {
+	return (sizeof(undoRecord) + len + 3) & ~(size_t)3;
+}
+
+void undoReserve(size_t size) {
+	if (size <= UJ.cap) return;
+	UJ.cap = UJ.cap * 2 > size ? UJ.cap * 2 : size + 4096;
+	UJ.buf = rsRealloc(UJ.buf, UJ.cap, MEM_UNDO);
+}
+
+void editorUndoClear() {
+	rsFree(UJ.buf, MEM_UNDO);
+	UJ.buf = NULL;
+	UJ.cap = UJ.len = UJ.pos = UJ.last = 0;
+	UJ.coalesce = 0;
+}
+
+// drops the oldest groups, down to three quarters of the limit
+void undoTrim() {
+	if (UJ.len <= UJ.limit) return;
+	size_t off = 0;
+	while (off < UJ.pos && UJ.len - off > UJ.limit / 4 * 3) {
+		unsigned group = undoAt(off)->group;
+		while (off < UJ.pos && undoAt(off)->group == group) off += undoSize(undoAt(off)->len);
+	}
+	memmove(UJ.buf, UJ.buf + off, UJ.len - off);
+	UJ.len -= off;
+	UJ.pos -= off;
+	UJ.last = UJ.last > off ? UJ.last - off : 0;
+	if (UJ.len) undoAt(0)->prev = 0;
+	if (UJ.pos == 0) UJ.coalesce = 0;
+}
+
+undoRecord *undoAppend(int type, int y, int x, int len) {
+	UJ.len = UJ.pos; // a new change: what was undone cannot be redone anymore
+	undoReserve(UJ.len + undoSize(len));
+	undoRecord *r = undoAt(UJ.len);
+	r->type = type;
+	r->reversed = 0;
+	r->y = y;
+	r->x = x;
+	r->len = len;
+	r->group = UJ.grouping ? UJ.group : ++UJ.group;
+	r->prev = UJ.pos ? UJ.pos - UJ.last : 0;
+	UJ.last = UJ.len;
+	UJ.len = UJ.pos = UJ.len + undoSize(len);
+	return r;
+}
+
+// makes room for n more bytes of text in the last record, and returns it
+char *undoExtend(int n) {
+	undoReserve(UJ.last + undoSize(undoAt(UJ.last)->len + n));
+	undoRecord *r = undoAt(UJ.last);
+	char *text = (char *)(r + 1) + r->len;
+	r->len += n;
+	UJ.len = UJ.pos = UJ.last + undoSize(r->len);
+	return text;
+}
+
+int undoCoalesces(int type) {
+	return UJ.coalesce && UJ.pos && undoAt(UJ.last)->type == type &&
+		timingNow() - UJ.time < KILO_UNDO_PAUSE;
+}
+
+void undoDone() {
+	UJ.coalesce = 1;
+	UJ.time = timingNow();
+	undoTrim();
+}
+
+/*
+ * Records the insert of len bytes of text at (y, x), before it is done
+ */
+void editorUndoInsert(int y, int x, const char *s, int len) {
+	if (UJ.replaying || len <= 0) return;
+
+	char *text;
+	if (undoCoalesces(CHANGE_INSERT) && y == UJ.end_y && x == UJ.end_x) {
+		text = undoExtend(len);
+	} else {
+		text = (char *)(undoAppend(CHANGE_INSERT, y, x, len) + 1);
+		UJ.end_y = y;
+		UJ.end_x = x;
+	}
+	memcpy(text, s, len);
+
+	const char *nl = memrchr(s, '\n', len);
+	if (nl == NULL) {
+		UJ.end_x += len;
+	} else {
+		for (const char *p = s; (p = memchr(p, '\n', nl + 1 - p)); p++) UJ.end_y++;
+		UJ.end_x = len - (nl + 1 - s);
+	}
+	undoDone();
+}
+
+/*
+ * Records the delete of len bytes of text from (y, x), before it is done.
+ * A run of backspaces keeps its text backward, as every char deleted goes
+ * before the others.
+ */
+void editorUndoDelete(int y, int x, int len) {
+	if (UJ.replaying || len <= 0) return;
+
+	if (undoCoalesces(CHANGE_DELETE)) {
+		undoRecord *r = undoAt(UJ.last);
+		int y2, x2;
+		editorTextEnd(y, x, len, &y2, &x2);
+		if (y2 == r->y && x2 == r->x && (r->reversed || r->len == 1)) {
+			char *text = undoExtend(len);
+			editorTextCopy(y, x, len, text);
+			for (int i = 0, j = len - 1; i < j; i++, j--) {
+				char c = text[i];
+				text[i] = text[j];
+				text[j] = c;
+			}
+			r = undoAt(UJ.last);
+			r->reversed = 1;
+			r->y = y;
+			r->x = x;
+			undoDone();
+			return;
+		}
+		if (y == r->y && x == r->x && !r->reversed) {
+			editorTextCopy(y, x, len, undoExtend(len));
+			undoDone();
+			return;
+		}
+	}
+	undoRecord *r = undoAppend(CHANGE_DELETE, y, x, len);
+	editorTextCopy(y, x, len, (char *)(r + 1));
+	undoDone();
+}
+
+/*
+ * Records made between editorUndoBegin and editorUndoEnd are one group
+ */
+void editorUndoBegin() {
+	if (UJ.grouping++ == 0) {
+		UJ.group++;
+		UJ.coalesce = 0;
+	}
+}
+
+void editorUndoEnd() {
+	if (--UJ.grouping == 0) UJ.coalesce = 0;
+}
+
+// does the record, or its opposite, and puts the cursor where it happened
+void undoApply(undoRecord *r, int opposite) {
+	const char *text = (const char *)(r + 1);
+	char *forward = NULL;
+	if (r->reversed) {
+		forward = malloc(r->len);
+		if (forward == NULL) die("malloc");
+		for (int i = 0; i < r->len; i++) forward[i] = text[r->len - 1 - i];
+		text = forward;
+	}
+
+	E.cy = r->y;
+	E.cx = r->x;
+	if ((r->type == CHANGE_INSERT) != opposite) {
+		editorInsertText(r->y, r->x, text, r->len);
+		editorTextEnd(r->y, r->x, r->len, &E.cy, &E.cx);
+	} else {
+		editorDeleteText(r->y, r->x, r->len);
+	}
+	free(forward);
+}
+
+void editorUndo() {
+	if (editorReadOnly()) return;
+	if (UJ.pos == 0) {
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+	unsigned group = undoAt(UJ.last)->group;
+	UJ.replaying = 1;
+	do {
+		undoApply(undoAt(UJ.last), 1);
+		UJ.pos = UJ.last;
+		if (UJ.pos) UJ.last -= undoAt(UJ.pos)->prev;
+	} while (UJ.pos && undoAt(UJ.last)->group == group);
+	UJ.replaying = 0;
+	UJ.coalesce = 0;
+}
+
+void editorRedo() {
+	if (editorReadOnly()) return;
+	if (UJ.pos == UJ.len) {
+		editorSetStatusMessage("Nothing to redo");
+		return;
+	}
+	unsigned group = undoAt(UJ.pos)->group;
+	UJ.replaying = 1;
+	do {
+		undoApply(undoAt(UJ.pos), 0);
+		UJ.last = UJ.pos;
+		UJ.pos += undoSize(undoAt(UJ.pos)->len);
+	} while (UJ.pos < UJ.len && undoAt(UJ.pos)->group == group);
+	UJ.replaying = 0;
+	UJ.coalesce = 0;
+}
+
+
+/*
+ * Every change goes to the undo journal and to the swap file
+ */
+void editorNoteInsert(int y, int x, const char *s, int len) {
+	editorSwapWrite(CHANGE_INSERT, y, x, s, len);
+	editorUndoInsert(y, x, s, len);
+}
+
+void editorNoteDelete(int y, int x, int len) {
+	editorSwapWrite(CHANGE_DELETE, y, x, NULL, len);
+	editorUndoDelete(y, x, len);
+}
+
+/*** swap ***/
+
+/*
+ * The swap file keeps the changes not saved yet, so that they survive a
+ * crash: it starts with the identity of the file the changes apply to, and
+ * every change appends a record, with the text of the inserts. Writing it
+ * costs the size of the changes, never the size of the file. Records reach
+ * the kernel at once, and the disk at most KILO_SWAP_SYNC later. The file
+ * is removed when the changes are saved or dropped.
+ */
+
+struct swapFile SW = {-1, NULL, 0, 0, 0, {{0}, 0, 0, 0}};
+
+// ".name.ext", next to the file
+char *editorSidecarPath(const char *filename, const char *ext) {
+	const char *base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	char *path = malloc(strlen(filename) + strlen(ext) + 3);
+	if (path == NULL) die("malloc");
+	sprintf(path, "%.*s.%s.%s", (int)(base - filename), filename, base, ext);
+	return path;
+}
+
+// what the file looks like now, a file not there yet is all zeros
+void editorSwapIdentity(swapHeader *h) {
+	struct stat st;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, KILO_SWAP_MAGIC, sizeof(h->magic));
+	if (stat(E.filename, &st) == -1) return;
+	h->size = st.st_size;
+	h->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	h->ino = st.st_ino;
+}
+
+int editorSwapWriteAll(struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t nwritten = writev(SW.fd, iov, n);
+		if (nwritten == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return 0;
+}
 
-	editorUpdateSyntax(row);
+void editorSwapWrite(int type, int y, int x, const char *s, int len) {
+	if (SW.replaying || E.filename == NULL || len <= 0) return;
+
+	if (SW.fd == -1) { // the first change since the file was opened or saved
+		free(SW.path);
+		SW.path = editorSidecarPath(E.filename, "kswp");
+		SW.fd = open(SW.path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		struct iovec iov = {&SW.base, sizeof(SW.base)};
+		if (SW.fd == -1 || editorSwapWriteAll(&iov, 1) == -1) {
+			editorSetStatusMessage("Can't write the swap file %s: %s", SW.path, strerror(errno));
+			if (SW.fd != -1) close(SW.fd);
+			SW.fd = -2; // no swap file until the next save
+			return;
+		}
+	}
+	if (SW.fd < 0) return;
+
+	swapRecord r = {type, y, x, len};
+	struct iovec iov[2] = {{&r, sizeof(r)}, {(void *)s, s ? len : 0}};
+	if (editorSwapWriteAll(iov, 2) == -1) {
+		editorSetStatusMessage("Can't write the swap file %s: %s", SW.path, strerror(errno));
+		close(SW.fd);
+		SW.fd = -2;
+		return;
+	}
+	SW.unsynced = 1;
+	editorSwapTick();
 }
 
+// called often, even when no key comes: syncs what was written long enough ago
+void editorSwapTick() {
+	if (SW.fd < 0 || !SW.unsynced) return;
+	double now = timingNow();
+	if (now - SW.synced < KILO_SWAP_SYNC) return;
+	fdatasync(SW.fd);
+	SW.unsynced = 0;
+	SW.synced = now;
+}
 
-void editorInsertRow(int at, char *s, size_t len) {
-	if (at < 0 || at > E.numrows) return;
+/*
+ * The changes are saved, or dropped: the swap file goes, and the next change
+ * starts a new one for the file as it is now.
+ */
+void editorSwapClose() {
+	if (SW.fd >= 0) close(SW.fd);
+	if (SW.path) unlink(SW.path);
+	SW.fd = -1;
+	SW.unsynced = 0;
+	if (E.filename) editorSwapIdentity(&SW.base);
+}
 
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-	for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+/*
+ * Applies the swap file left by an editor that did not save, if it was
+ * made for the file as it is now. Changes stop at the first record not
+ * written entirely, and the next ones are appended after it.
+ */
+void editorSwapRecover() {
+	free(SW.path);
+	SW.path = editorSidecarPath(E.filename, "kswp");
+	SW.fd = -1;
+	editorSwapIdentity(&SW.base);
+
+	FILE *fp = fopen(SW.path, "r");
+	if (fp == NULL) return;
+	swapHeader h;
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(&h, &SW.base, sizeof(h))) {
+		fclose(fp);
+		editorSetStatusMessage("Swap file %s is not for this version of the file, "
+			"it will be replaced", SW.path);
+		return;
+	}
+
+	editorFilterEnd(); // its rows are about to move
+	struct stat st;
+	long size = fstat(fileno(fp), &st) == 0 ? st.st_size : 0;
+	long good = sizeof(h);
+	int changes = 0;
+	char *text = NULL;
+	swapRecord r;
+	SW.replaying = 1;
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		// a torn or foreign record ends the replay, the swap file is cut before it
+		uint32_t rows = E.numrows;
+		if (r.len > INT32_MAX || r.y > rows || (r.type == CHANGE_DELETE && r.y == rows) ||
+			r.x > (uint32_t)(r.y < rows ? E.row[r.y].size : 0))
+			break;
+		if (r.type == CHANGE_INSERT) {
+			if (r.len > size - good - (long)sizeof(r)) break;
+			text = realloc(text, r.len);
+			if (text == NULL) die("realloc");
+			if (fread(text, 1, r.len, fp) != r.len) break;
+			editorInsertText(r.y, r.x, text, r.len);
+			good += sizeof(r) + r.len;
+		} else if (r.type == CHANGE_DELETE) {
+			editorDeleteText(r.y, r.x, r.len);
+			good += sizeof(r);
+		} else {
+			break;
+		}
+		changes++;
+	}
+	SW.replaying = 0;
+	free(text);
+	fclose(fp);
+
+	SW.fd = open(SW.path, O_WRONLY | O_APPEND);
+	if (SW.fd != -1 && ftruncate(SW.fd, good) == -1) {
+		close(SW.fd);
+		SW.fd = -1;
+	}
+	if (changes == 0) {
+		editorSwapClose();
+		return;
+	}
+	E.dirty = changes;
+	editorSetStatusMessage("Recovered %d unsaved changes from %s", changes, SW.path);
+}
+
+/*** file i/o ***/
+
+/*
+ * Compressed files are told by their first bytes, and go through the
+ * program that knows the format, run as a child: what it decompresses is
+ * read from a pipe as it comes, like any stream. Nothing is written to a
+ * temporary file.
+ */
+struct editorCompressor CMDB[] = {
+	{"gzip", ".gz", "\x1f\x8b", 2},
+	{"zstd", ".zst", "\x28\xb5\x2f\xfd", 4},
+};
+
+#define CMDB_ENTRIES (sizeof(CMDB) / sizeof(CMDB[0]))
+
+struct editorCompressor *editorCompressorOf(int fd) {
+	char magic[8];
+	ssize_t len = pread(fd, magic, sizeof(magic), 0);
+	for (unsigned int j = 0; j < CMDB_ENTRIES; j++) {
+		if (len >= CMDB[j].magic_len && !memcmp(magic, CMDB[j].magic, CMDB[j].magic_len))
+			return &CMDB[j];
+	}
+	return NULL;
+}
+
+// the one a file with this name is saved with
+struct editorCompressor *editorCompressorFor(const char *filename) {
+	char *ext = strrchr(filename, '.');
+	for (unsigned int j = 0; ext && j < CMDB_ENTRIES; j++) {
+		if (!strcmp(ext, CMDB[j].ext)) return &CMDB[j];
+	}
+	return NULL;
+}
+
+/*
+ * Runs the compressor with the option given, reading from in and writing to
+ * out. Its complaints would garble the screen: they go nowhere.
+ */
+pid_t editorCompressorRun(struct editorCompressor *c, char *option, int in, int out) {
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+	signal(SIGPIPE, SIG_DFL); // the editor ignores it, the compressor must not
+	int null = open("/dev/null", O_WRONLY);
+	dup2(in, STDIN_FILENO);
+	dup2(out, STDOUT_FILENO);
+	if (null != -1) dup2(null, STDERR_FILENO);
+	execlp(c->program, c->program, option, (char *)NULL);
+	_exit(127);
+}
+
+/*
+ * The text of the file, decompressed by a child when it is compressed: then
+ * the pid of the child is set, to wait for once the pipe is read
+ */
+int editorOpenText(const char *filename, struct editorCompressor **c, pid_t *pid) {
+	*pid = -1;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) return -1;
+	*c = editorCompressorOf(fd);
+	if (*c == NULL) return fd;
+
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) == -1) {
+		close(fd);
+		return -1;
+	}
+	*pid = editorCompressorRun(*c, "-dc", fd, p[1]);
+	close(fd);
+	close(p[1]);
+	if (*pid == -1) {
+		close(p[0]);
+		return -1;
+	}
+	return p[0];
+}
+
+// 0 when the child did its job, an error message is shown otherwise
+int editorCompressorWait(struct editorCompressor *c, pid_t pid) {
+	int status;
+	if (waitpid(pid, &status, 0) == -1) {
+		editorSetStatusMessage("%s: %s", c->program, strerror(errno));
+		return -1;
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return 0;
+	editorSetStatusMessage(WIFEXITED(status) && WEXITSTATUS(status) == 127 ?
+		"Can't run %s" : "%s failed", c->program);
+	return -1;
+}
+
+/**
+ * concatenete the rows in a string ready to be saved
+ * @param  buflen pointer to int, to return the length of the buffer to caller
+ * @return   buffer of chars, ready to be saved
+ */
+char* editorRowsToString(int *buflen) {
+	int totlen = 0;
+	int j;
+	for (j = 0; j < E.numrows; ++j)	{
+		totlen += E.row[j].size + 1; // add one to make room for the new line char
+	}
+	*buflen = totlen;
+
+	char *buf = malloc(totlen);
+	char *p = buf;
+	for (j = 0; j < E.numrows; j++) {
+		memcpy(p, E.row[j].chars, E.row[j].size);
+		p += E.row[j].size;
+		*p = '\n';
+		p++;
+	}
+	return buf;
+}
+
+void editorOpen(char *filename) {
+	E.filename = strdup(filename);
+
+	editorSelectSyntaxHighlight();
+
+	pid_t pid;
+	int fd = editorOpenText(filename, &E.compressor, &pid);
+	if (fd == -1) die("open");
+	if (pid != -1) { // rows come as they are decompressed, see editorStreamRead
+		editorStream(fd);
+		FL.pid = pid;
+		return;
+	}
+	if (editorCacheLoad(fd)) {
+		close(fd);
+	} else {
+		FILE *fp = fdopen(fd, "r");
+		if (!fp) die("fdopen");
+
+		char *line = NULL;
+		size_t linecap = 0;
+		ssize_t linelen;
+		while ((linelen = getline(&line, &linecap, fp)) != -1) {
+			while (linelen > 0 && (line[linelen - 1] == '\r' ||
+								  line[linelen - 1] == '\n'))
+				linelen--;
+			editorInsertRow(E.numrows, line, linelen);
+		}
+		free(line);
+		fclose(fp);
+		editorCacheWrite();
+	}
+	editorUndoClear();
+	E.dirty = 0;
+	editorSwapRecover();
+}
+
+void editorSave() {
+	if (editorReadOnly()) return;
+	editorDiskCheck();
+	if (E.disk_changed == 1) {
+		editorSetStatusMessage("%s changed on disk! Ctrl-S again overwrites it, "
+			"Ctrl-R reloads it", E.filename);
+		E.disk_changed = 2;
+		return;
+	}
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s", NULL);
+
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();		
+	}
 	
-	E.row[at].idx  = at;
-
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
-	editorUpdateRow(&E.row[at]);
+	int len;
+	char *buf = editorRowsToString(&len);
 
-	E.numrows++;
-	E.dirty++;
+	struct editorCompressor *c = E.compressor ? E.compressor : editorCompressorFor(E.filename);
+	if (c) {
+		editorSaveCompressed(c, buf, len);
+		free(buf);
+		return;
+	}
+
+	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+	if (fd != -1) {
+		if (ftruncate(fd, len) != -1) {
+			if (write(fd, buf, len) == len) {
+				close(fd);
+				free(buf);
+				E.dirty = 0;
+				E.disk_changed = 0;
+				editorSwapClose();
+				editorCacheWrite();
+				editorSetStatusMessage("%d bytes written to disk", len);
+				return;
+			}
+		}
+		close(fd);
+	}
+	free(buf);
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-void editorFreeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+/*
+ * Saves through the compressor, which writes the file: a file opened
+ * compressed stays compressed, and so does one named like it
+ */
+void editorSaveCompressed(struct editorCompressor *c, char *buf, int len) {
+	// the compressor writes a new file that replaces the old one only when it
+	// succeeded: a missing or failing compressor leaves the old one as it was
+	char *tmp = editorSidecarPath(E.filename, "new");
+	int p[2] = {-1, -1};
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1 || pipe2(p, O_CLOEXEC) == -1) {
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+		if (fd != -1) close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+	struct stat st;
+	if (stat(E.filename, &st) == 0) fchmod(fd, st.st_mode & 07777);
+	pid_t pid = editorCompressorRun(c, "-c", p[0], fd);
+	int error = errno;
+	close(p[0]);
+	close(fd);
+	ssize_t nwritten = pid == -1 ? -1 : write(p[1], buf, len);
+	if (pid != -1) error = errno;
+	close(p[1]);
+
+	int ok = pid != -1 && editorCompressorWait(c, pid) == 0; // it tells why it failed
+	if (pid == -1) {
+		editorSetStatusMessage("Can't save! Can't run %s: %s", c->program, strerror(error));
+	} else if (ok && nwritten != len) {
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(error));
+		ok = 0;
+	} else if (ok && rename(tmp, E.filename) == -1) {
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+		ok = 0;
+	}
+	if (!ok) {
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+	free(tmp);
+
+	E.dirty = 0;
+	E.disk_changed = 0;
+	E.compressor = c;
+	editorSwapClose();
+	editorSetStatusMessage("%d bytes written to disk, %lld with %s", len,
+		stat(E.filename, &st) == 0 ? (long long)st.st_size : 0LL, c->program);
 }
 
-void editorDelRow(int at) {
-	if (at < 0 || at >= E.numrows) return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-	E.numrows--;
-	E.dirty++;
+/*
+ * Tells once when the file on disk is no longer the one opened or saved,
+ * by its size, mtime and inode. Cheap enough for every key wait.
+ */
+void editorDiskCheck() {
+	if (E.filename == NULL || FL.fd != -1 || E.disk_changed) return;
+	swapHeader now;
+	editorSwapIdentity(&now);
+	if (!memcmp(&now, &SW.base, sizeof(now))) return;
+	E.disk_changed = 1;
+	editorSetStatusMessage("%s changed on disk! Ctrl-R reloads it", E.filename);
 }
 
+uint64_t editorLineHash(const char *s, int len) {
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for (int j = 0; j < len; j++) h = (h ^ (unsigned char)s[j]) * 1099511628211ULL;
+	return h;
+}
 
-void editorRowInsertChar(erow *row, int at, int c) {
-	if (at < 0 || at > row->size) at = row->size;	
-	row->chars = realloc(row->chars, row->size + 2); // add two, because the actual length of the buffer (NOT the size value) 
-													 //	also includes the null byte to terminate the string			
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // memmove must be used insted of memcpy if the memory area overlap
-	row->size++;
-	row->chars[at] = c;		
-	editorUpdateRow(row);
-	E.dirty++;
+/*
+ * Text read for a reload or from a command, cut in lines the way
+ * editorOpen makes rows
+ */
+struct diskLines {
+	char *buf;
+	int n;
+	int *off, *len;
+};
+
+void diskLinesSplit(struct diskLines *dl, size_t size) {
+	int cap = 0;
+	for (char *line = dl->buf; line < dl->buf + size; ) {
+		char *nl = memchr(line, '\n', dl->buf + size - line);
+		int linelen = nl ? nl - line : dl->buf + size - line;
+		if (dl->n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			dl->off = realloc(dl->off, sizeof(int) * cap);
+			dl->len = realloc(dl->len, sizeof(int) * cap);
+			if (dl->off == NULL || dl->len == NULL) die("realloc");
+		}
+		dl->off[dl->n] = line - dl->buf;
+		while (linelen > 0 && line[linelen - 1] == '\r') linelen--;
+		dl->len[dl->n++] = linelen;
+		line = nl ? nl + 1 : dl->buf + size;
+	}
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size +len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+int diskLineEq(struct diskLines *dl, int o, int n) {
+	return E.row[o].size == dl->len[n] &&
+		!memcmp(E.row[o].chars, dl->buf + dl->off[n], dl->len[n]);
 }
 
-void editorRowDeleteChar(erow *row, int at) {
-	if (at < 0 || at >= row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+// rows o0 to o1 become lines n0 to n1, which differ at both ends
+struct diffHunk {
+	int o0, o1, n0, n1;
+};
+
+/*
+ * Adds the hunk that turns rows [o0, o1) into lines [n0, n1), without the
+ * rows and lines that are equal at its ends.
+ */
+void diffGap(struct diskLines *dl, int o0, int o1, int n0, int n1,
+		struct diffHunk **h, int *nh) {
+	while (o0 < o1 && n0 < n1 && diskLineEq(dl, o0, n0)) o0++, n0++;
+	while (o0 < o1 && n0 < n1 && diskLineEq(dl, o1 - 1, n1 - 1)) o1--, n1--;
+	if (o0 == o1 && n0 == n1) return;
+	*h = realloc(*h, sizeof(struct diffHunk) * (*nh + 1));
+	if (*h == NULL) die("realloc");
+	(*h)[(*nh)++] = (struct diffHunk){o0, o1, n0, n1};
 }
 
-/*** editor operations ***/
-void editorInsertChar(int c) {
-	if (E.cy == E.numrows) {
-		editorInsertRow(E.numrows, "", 0);
+struct diffSlot {
+	uint64_t hash;
+	int nold, nnew; // how many times the line is in the rows and in the file
+	int old; 		// where in the rows, when just once
+};
+
+int *diffAlloc(int n) {
+	int *p = malloc(sizeof(int) * (n + 1));
+	if (p == NULL) die("malloc");
+	return p;
+}
+
+/*
+ * Adds the hunks that turn rows [o0, o1) into lines [n0, n1). The lines
+ * found once in both, in the same order, are kept (patience diff), and
+ * the rows between them are compared from both ends.
+ */
+void diffPatience(struct diskLines *dl, int o0, int o1, int n0, int n1,
+		struct diffHunk **h, int *nh) {
+	int size = 16;
+	while (size < 2 * (o1 - o0)) size *= 2;
+	struct diffSlot *slots = calloc(size, sizeof(struct diffSlot));
+	if (slots == NULL) die("calloc");
+	for (int j = o0; j < o1; j++) {
+		uint64_t hash = editorLineHash(E.row[j].chars, E.row[j].size);
+		int i = hash & (size - 1);
+		while (slots[i].nold && slots[i].hash != hash) i = (i + 1) & (size - 1);
+		slots[i].hash = hash;
+		slots[i].nold++;
+		slots[i].old = j;
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	// only the lines that are in the rows too can be kept
+	int *slot = diffAlloc(n1 - n0);
+	for (int j = n0; j < n1; j++) {
+		uint64_t hash = editorLineHash(dl->buf + dl->off[j], dl->len[j]);
+		int i = hash & (size - 1);
+		while (slots[i].nold && slots[i].hash != hash) i = (i + 1) & (size - 1);
+		slot[j - n0] = slots[i].nold ? i : -1;
+		if (slots[i].nold) slots[i].nnew++;
+	}
+
+	// the unique lines in file order, and the longest run of them in row order too
+	int *olds = diffAlloc(n1 - n0), *news = diffAlloc(n1 - n0);
+	int *tops = diffAlloc(n1 - n0), *prev = diffAlloc(n1 - n0);
+	int k = 0, ntops = 0;
+	for (int j = n0; j < n1; j++) {
+		struct diffSlot *sl = slot[j - n0] == -1 ? NULL : &slots[slot[j - n0]];
+		if (!sl || sl->nold != 1 || sl->nnew != 1 || !diskLineEq(dl, sl->old, j)) continue;
+		olds[k] = sl->old;
+		news[k] = j;
+		int lo = 0, hi = ntops; // the first pile whose top comes after this row
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (olds[tops[mid]] < olds[k]) lo = mid + 1;
+			else hi = mid;
+		}
+		prev[k] = lo ? tops[lo - 1] : -1;
+		tops[lo] = k;
+		if (lo == ntops) ntops++;
+		k++;
+	}
+
+	// the run backwards, then the gaps between its lines forwards
+	int n = 0;
+	for (int i = ntops ? tops[ntops - 1] : -1; i != -1; i = prev[i]) tops[n++] = i;
+	for (int i = n - 1; i >= 0; i--) {
+		diffGap(dl, o0, olds[tops[i]], n0, news[tops[i]], h, nh);
+		o0 = olds[tops[i]] + 1;
+		n0 = news[tops[i]] + 1;
+	}
+	diffGap(dl, o0, o1, n0, n1, h, nh);
+
+	free(slots);
+	free(slot);
+	free(olds);
+	free(news);
+	free(tops);
+	free(prev);
 }
 
-void editorInsertNewline() {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
+/*
+ * Whether rows and lines are equal again at (o + do, n + dn), for
+ * KILO_DIFF_RUN of them or up to the end of both
+ */
+int diffSynced(struct diskLines *dl, int o, int n) {
+	for (int k = 0; k < KILO_DIFF_RUN; k++, o++, n++) {
+		if (o == E.numrows || n == dl->n) return o == E.numrows && n == dl->n;
+		if (!diskLineEq(dl, o, n)) return 0;
 	}
-	else {
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;		
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+	return 1;
+}
+
+/*
+ * The hunks that turn the rows into the lines, in order. Rows and lines
+ * are walked together: after a difference, the nearest place where they
+ * are equal again is looked for within KILO_DIFF_WINDOW, so a few small
+ * changes cost a compare of every line. Farther than that, the rest is
+ * left to diffPatience.
+ */
+struct diffHunk *editorDiff(struct diskLines *dl, int *nh) {
+	struct diffHunk *h = NULL;
+	*nh = 0;
+	int o = 0, n = 0, no = E.numrows, nn = dl->n;
+	while (o < no && n < nn) {
+		if (diskLineEq(dl, o, n)) {
+			o++, n++;
+			continue;
+		}
+		int found = 0;
+		for (int d = 1; d <= 2 * KILO_DIFF_WINDOW && !found; d++) {
+			for (int dold = 0; dold <= d && !found; dold++) {
+				int dnew = d - dold;
+				if (dold > KILO_DIFF_WINDOW || dnew > KILO_DIFF_WINDOW) continue;
+				if (o + dold > no || n + dnew > nn || !diffSynced(dl, o + dold, n + dnew)) continue;
+				diffGap(dl, o, o + dold, n, n + dnew, &h, nh);
+				o += dold;
+				n += dnew;
+				found = 1;
+			}
+		}
+		if (!found) {
+			int q = 0;
+			while (q < no - o && q < nn - n && diskLineEq(dl, no - 1 - q, nn - 1 - q)) q++;
+			diffPatience(dl, o, no - q, n, nn - q, &h, nh);
+			return h;
+		}
 	}
-	E.cy++;
-	E.cx = 0;
+	diffGap(dl, o, no, n, nn, &h, nh);
+	return h;
 }
 
-void editorDelChar() {
-	if (E.cy == E.numrows) return; // last line
-	if (E.cx == 0 && E.cy == 0) return; // beginning of the file
+/*
+ * Rows [o0, o1) become lines [n0, n1), through the text operations: the
+ * rows before and after, and what is computed for them, stay as they are.
+ */
+void editorReplaceRows(struct diskLines *dl, struct diffHunk *h) {
+	int n = h->o1 - h->o0, m = h->n1 - h->n0;
+	int del = n; // the bytes of the rows, and a newline for every one
+	for (int j = h->o0; j < h->o1; j++) del += E.row[j].size;
+
+	int len = m;
+	for (int j = h->n0; j < h->n1; j++) len += dl->len[j];
+	char *text = malloc(len + 1), *t = text;
+	if (text == NULL) die("malloc");
+
+	int y = h->o0, x = 0;
+	if (h->o1 < E.numrows) { // rows follow: every line ends with a newline
+		for (int j = h->n0; j < h->n1; j++) {
+			memcpy(t, dl->buf + dl->off[j], dl->len[j]);
+			t += dl->len[j];
+			*t++ = '\n';
+		}
+	} else if (h->o0 > 0) { // the end of the file: every line starts with one
+		y = h->o0 - 1;
+		x = E.row[y].size;
+		for (int j = h->n0; j < h->n1; j++) {
+			*t++ = '\n';
+			memcpy(t, dl->buf + dl->off[j], dl->len[j]);
+			t += dl->len[j];
+		}
+	} else { // the whole file: newlines only go between the lines
+		if (del) del--;
+		for (int j = h->n0; j < h->n1; j++) {
+			if (j > h->n0) *t++ = '\n';
+			memcpy(t, dl->buf + dl->off[j], dl->len[j]);
+			t += dl->len[j];
+		}
+	}
+	editorDeleteText(y, x, del);
+	editorInsertText(y, x, text, t - text);
+	if (E.numrows == 0 && m > 0) editorInsertRow(0, "", 0); // a file of one empty line
+	free(text);
+
+	// the cursor and the view stay on the rows they were on
+	if (E.cy >= h->o1) E.cy += m - n;
+	else if (E.cy >= h->o0) E.cy = h->o0;
+	if (E.rowoff >= h->o1) E.rowoff += m - n;
+	else if (E.rowoff > h->o0) E.rowoff = h->o0;
+}
 
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDeleteChar(row, E.cx - 1);
-		E.cx--;
+/*
+ * Makes the rows what the file on disk has now, changing only the rows that
+ * differ. The reload is a single undo group: Ctrl-Z brings back what was
+ * shown before, unsaved changes included.
+ */
+void editorReload() {
+	if (editorReadOnly()) return;
+	if (E.filename == NULL) return;
+
+	struct diskLines dl = {NULL, 0, NULL, NULL};
+	struct editorCompressor *c;
+	pid_t pid;
+	int fd = editorOpenText(E.filename, &c, &pid);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		editorSetStatusMessage("Can't reload %s: %s", E.filename, strerror(errno));
+		if (fd != -1) close(fd);
+		return;
 	}
-	else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+	// a pipe has no size: the buffer grows as needed
+	ssize_t size = 0, nread, bufsize = S_ISREG(st.st_mode) ? st.st_size + 1 : 1 << 20;
+	dl.buf = malloc(bufsize);
+	if (dl.buf == NULL) die("malloc");
+	while ((nread = read(fd, dl.buf + size, bufsize - size)) > 0) {
+		size += nread;
+		if (size == bufsize) {
+			dl.buf = realloc(dl.buf, bufsize *= 2);
+			if (dl.buf == NULL) die("realloc");
+		}
+	}
+	close(fd);
+	if (pid != -1 && editorCompressorWait(c, pid) == -1) {
+		free(dl.buf);
+		return;
+	}
+	E.compressor = c;
+	diskLinesSplit(&dl, size);
+
+	int nh, changed = 0;
+	struct diffHunk *h = editorDiff(&dl, &nh);
+	SW.replaying = 1; // the swap file is for the changes not on disk: there are none left
+	editorUndoBegin();
+	for (int i = nh - 1; i >= 0; i--) { // from the end, so the rows of the others don't move
+		changed += h[i].o1 - h[i].o0 + h[i].n1 - h[i].n0;
+		editorReplaceRows(&dl, &h[i]);
+	}
+	editorUndoEnd();
+	SW.replaying = 0;
+
+	if (E.cy > E.numrows) E.cy = E.numrows;
+	if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+	E.dirty = 0;
+	E.disk_changed = 0;
+	editorSwapClose();
+	editorSetStatusMessage("Reloaded %s: %d regions, %d rows changed", E.filename, nh, changed);
+	free(h);
+	free(dl.buf);
+	free(dl.off);
+	free(dl.len);
+}
+
+/*** cache ***/
+
+/*
+ * Opening a big file is mostly highlighting it, since the open comment
+ * state of a row depends on all the rows before it. The index cache keeps
+ * those states, and where the rows start, in ".name.kidx" next to the file.
+ * A file opened with a valid cache is cut in rows at the offsets and no row
+ * is highlighted before it is drawn. The cache is written when a file at
+ * least E.cache_min big is opened without one, and when it is saved.
+ */
+
+// what the open comment states depend on, 0 without a syntax
+uint64_t editorSyntaxHash() {
+	struct editorSyntax *s = E.syntax;
+	if (s == NULL) return 0;
+	char *parts[] = {s->filetype, s->singleline_comment_start,
+		s->multiline_comment_start, s->multiline_comment_end};
+	uint64_t h = s->flags;
+	for (int j = 0; j < 4; j++) {
+		char *p = parts[j] ? parts[j] : "";
+		h = h * 31 + editorLineHash(p, strlen(p));
+	}
+	return h | 1;
+}
+
+/*
+ * Makes the rows of the file open in fd from its cache, if it has a valid
+ * one. Returns whether it did.
+ */
+int editorCacheLoad(int fd) {
+	if (E.cache_min == 0) return 0;
+	swapHeader id;
+	editorSwapIdentity(&id);
+	if (id.size < E.cache_min) return 0;
+
+	char *path = editorSidecarPath(E.filename, "kidx");
+	int cfd = open(path, O_RDONLY);
+	free(path);
+	if (cfd == -1) return 0;
+	struct stat st;
+	char *cache = MAP_FAILED;
+	if (fstat(cfd, &st) == 0 && st.st_size >= (off_t)sizeof(cacheHeader))
+		cache = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+	close(cfd);
+	if (cache == MAP_FAILED) return 0;
+
+	cacheHeader *h = (cacheHeader *)cache;
+	uint64_t n = h->nrows;
+	uint64_t *off = (uint64_t *)(h + 1);
+	int valid = !memcmp(h->file.magic, KILO_CACHE_MAGIC, sizeof(h->file.magic)) &&
+		h->file.size == id.size && h->file.mtime_ns == id.mtime_ns && h->file.ino == id.ino &&
+		h->syntax == editorSyntaxHash() && n < INT32_MAX &&
+		(uint64_t)st.st_size == sizeof(cacheHeader) + sizeof(uint64_t) * (n + 1) + (n + 7) / 8;
+	for (uint64_t j = 0; valid && j < n; j++) valid = off[j] <= off[j + 1];
+	if (valid) valid = off[0] == 0 && off[n] == id.size;
+
+	char *text = MAP_FAILED;
+	if (valid && id.size) text = mmap(NULL, id.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!valid || (id.size && text == MAP_FAILED)) {
+		munmap(cache, st.st_size);
+		return 0;
 	}
-}
+	if (id.size) madvise(text, id.size, MADV_SEQUENTIAL);
 
+	// plain text rows first, they get their states after
+	struct editorSyntax *syntax = E.syntax;
+	E.syntax = NULL;
+	for (uint64_t j = 0; j < n; j++) {
+		size_t len = off[j + 1] - off[j];
+		while (len > 0 && (text[off[j] + len - 1] == '\r' || text[off[j] + len - 1] == '\n')) len--;
+		editorInsertRow(E.numrows, &text[off[j]], len);
+	}
+	E.syntax = syntax;
+
+	unsigned char *bits = (unsigned char *)(off + n + 1);
+	for (int j = 0; j < E.numrows; j++) {
+		erow *row = &E.row[j];
+		row->hl_open_comment = bits[j / 8] >> (j % 8) & 1;
+		if (row->ll) { // its windows resume from the start state, and its end is known
+			row->ll->checks[0].st = editorRowStartState(row);
+			row->ll->nchecks = 1;
+			row->ll->nsure = 1;
+			row->ll->end = row->ll->checks[0].st;
+			row->ll->end.in_comment = row->hl_open_comment;
+			row->ll->end_valid = 1;
+		} else if (syntax) {
+			row->nhl = -1;
+		}
+	}
 
-/*** file i/o ***/
+	if (id.size) munmap(text, id.size);
+	munmap(cache, st.st_size);
+	return 1;
+}
 
-/**
- * concatenete the rows in a string ready to be saved
- * @param  buflen pointer to int, to return the length of the buffer to caller
- * @return   buffer of chars, ready to be saved
+/*
+ * Writes the cache of the file, whose rows must be the ones on disk. The
+ * offsets come from the file itself: rows lose the '\r' of a "\r\n".
  */
-char* editorRowsToString(int *buflen) {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; ++j)	{
-		totlen += E.row[j].size + 1; // add one to make room for the new line char
+void editorCacheWrite() {
+	if (E.cache_min == 0 || E.filename == NULL || E.compressor || FL.fd != -1) return;
+	swapHeader id;
+	editorSwapIdentity(&id);
+	if (id.size < E.cache_min) return;
+
+	int fd = open(E.filename, O_RDONLY);
+	if (fd == -1) return;
+	char *text = mmap(NULL, id.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) return;
+	editorHlResolve(E.numrows); // the open comment state of every row is saved
+
+	uint64_t n = E.numrows;
+	size_t len = sizeof(cacheHeader) + sizeof(uint64_t) * (n + 1) + (n + 7) / 8;
+	char *buf = calloc(len, 1);
+	if (buf == NULL) die("calloc");
+	cacheHeader *h = (cacheHeader *)buf;
+	h->file = id;
+	memcpy(h->file.magic, KILO_CACHE_MAGIC, sizeof(h->file.magic));
+	h->syntax = editorSyntaxHash();
+	h->nrows = n;
+
+	uint64_t *off = (uint64_t *)(h + 1);
+	unsigned char *bits = (unsigned char *)(off + n + 1);
+	uint64_t j = 0;
+	for (char *p = text, *end = text + id.size; p < end && j < n; j++) {
+		char *nl = memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+		off[j + 1] = p - text;
+		if (E.syntax && editorRowOpenComment(&E.row[j])) bits[j / 8] |= 1 << (j % 8);
+	}
+	munmap(text, id.size);
+	if (j != n || off[n] != id.size) { // not the rows of the file
+		free(buf);
+		return;
 	}
-	*buflen = totlen;
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
+	// a reader sees the old cache or the new one, never half of one
+	char *path = editorSidecarPath(E.filename, "kidx");
+	char *tmp = malloc(strlen(path) + 5);
+	if (tmp == NULL) die("malloc");
+	sprintf(tmp, "%s.new", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1) {
+		int ok = write(fd, buf, len) == (ssize_t)len;
+		close(fd);
+		if (!ok || rename(tmp, path) == -1) unlink(tmp);
 	}
-	return buf;
+	free(tmp);
+	free(path);
+	free(buf);
 }
 
-void editorOpen(char *filename) {
-	E.filename = strdup(filename);
+/*** follow ***/
 
-	editorSelectSyntaxHighlight();
+/*
+ * A followed file is shown as it grows, like with tail -f: the bytes
+ * appended to it since the last poll become rows at the end, all at once.
+ * When the file is truncated, or another file takes its name, reading goes
+ * on from the start of it. Keys can't change what is shown.
+ *
+ * A stream, like a pipe on stdin, is read the same way as it comes, up to
+ * its end. Then it can be edited and saved to a file.
+ */
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("fopen");
+struct followFile FL = {-1, -1, -1, 0, 0, 0, -1, 0, 0, NULL};
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\r' ||
-							  line[linelen - 1] == '\n'))
-			linelen--;
-		editorInsertRow(E.numrows, line, linelen);
+int editorReadOnly() {
+	if (FV.active) {
+		editorSetStatusMessage("Read only in the filtered view: Ctrl-E goes back to the file");
+		return 1;
 	}
-	E.dirty = 0;
-	free(line);
-	fclose(fp);
+	if (FL.fd == -1) return 0;
+	if (FL.stream) editorSetStatusMessage("Read only until the end of the input");
+	else editorSetStatusMessage("Read only: following %s", E.filename);
+	return 1;
 }
 
-void editorSave() {
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s", NULL);
+/*
+ * Adds the bytes at the end, the first line completes the last row when that
+ * has no newline yet. A followed file keeps the cursor on the last row.
+ */
+void editorFollowAppend(char *s, int len) {
+	int at_end = !FL.stream && E.cy >= E.numrows - 1, dirty = E.dirty;
+	if (FL.open && E.numrows > 0) {
+		char *nl = memchr(s, '\n', len);
+		editorRowAppendString(&E.row[E.numrows - 1], s, nl ? nl - s : len);
+		FL.open = nl == NULL;
+		if (nl) {
+			len -= nl + 1 - s;
+			s = nl + 1;
+		} else {
+			len = 0;
+		}
+	}
+	if (len > 0) {
+		FL.open = s[len - 1] != '\n';
+		editorInsertRows(E.numrows, s, FL.open ? len : len - 1);
+	}
+	E.dirty = dirty;
+	if (at_end && E.numrows > 0) {
+		E.cy = E.numrows - 1;
+		E.cx = 0;
+	}
+}
 
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
+// the file that has the name now, watched as soon as it is open
+int editorFollowOpen() {
+	int fd = open(E.filename, O_RDONLY);
+	if (fd == -1) return -1;
+	struct stat st;
+	fstat(fd, &st);
+	if (FL.fd != -1) close(FL.fd);
+	FL.fd = fd;
+	FL.ino = st.st_ino;
+	FL.offset = 0;
+	FL.open = 0;
+	if (FL.ifd != -1) {
+		if (FL.wd != -1) inotify_rm_watch(FL.ifd, FL.wd);
+		FL.wd = inotify_add_watch(FL.ifd, E.filename,
+			IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	}
+	return 0;
+}
+
+/*
+ * Reads at most KILO_FOLLOW_BATCH new bytes, and returns whether there were any
+ */
+int editorFollowRead() {
+	struct stat st;
+	if (fstat(FL.fd, &st) == -1) return 0;
+	if (st.st_size < FL.offset) {
+		editorSetStatusMessage("%s was truncated", E.filename);
+		FL.offset = 0;
+		FL.open = 0;
+	}
+	off_t len = st.st_size - FL.offset;
+	if (len > KILO_FOLLOW_BATCH) len = KILO_FOLLOW_BATCH;
+	if (len <= 0) return 0;
+
+	char *buf = malloc(len);
+	if (buf == NULL) die("malloc");
+	len = pread(FL.fd, buf, len, FL.offset);
+	if (len <= 0) {
+		free(buf);
+		return 0;
+	}
+	FL.offset += len;
+	editorFollowAppend(buf, len);
+	free(buf);
+	return 1;
+}
+
+/*
+ * Reads what the stream has, up to KILO_FOLLOW_BATCH bytes, without waiting
+ * for more. At its end the rows can be edited.
+ */
+int editorStreamRead() {
+	if (FL.buf == NULL) { // once for the whole stream, a trickle is read on every poll
+		FL.buf = malloc(KILO_FOLLOW_BATCH);
+		if (FL.buf == NULL) die("malloc");
+	}
+	int len = 0;
+	ssize_t nread = 0;
+	while (len < KILO_FOLLOW_BATCH &&
+		(nread = read(FL.fd, FL.buf + len, KILO_FOLLOW_BATCH - len)) > 0) len += nread;
+	if (len) editorFollowAppend(FL.buf, len);
+	FL.offset += len;
+
+	if (nread == 0 || (nread == -1 && errno != EAGAIN && errno != EINTR)) {
+		if (nread == -1) editorSetStatusMessage("Can't read the input: %s", strerror(errno));
+		else editorSetStatusMessage("%lld bytes read from the input", (long long)FL.offset);
+		close(FL.fd);
+		FL.fd = -1;
+		free(FL.buf);
+		FL.buf = NULL;
+		if (FL.pid != -1) { // a compressed file is complete: it can have a swap file
+			editorCompressorWait(E.compressor, FL.pid);
+			FL.pid = -1;
+			editorSwapRecover();
 		}
-		editorSelectSyntaxHighlight();		
+		return 1;
 	}
-	
-	int len;
-	char *buf = editorRowsToString(&len);
+	return len > 0;
+}
 
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
+/*
+ * Checks the file for new bytes, when inotify says it changed, and returns
+ * whether rows changed. Without inotify it checks on every call.
+ */
+int editorFollowPoll() {
+	if (FL.fd == -1) return 0;
+	if (FL.stream) return editorStreamRead();
+
+	int changed = FL.ifd == -1;
+	if (FL.ifd == -1) FL.check = 1;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while (FL.ifd != -1 && (len = read(FL.ifd, events, sizeof(events))) > 0) {
+		changed = 1;
+		for (char *p = events; p < events + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->mask & ~IN_MODIFY) FL.check = 1; // renamed or deleted: another file may take the name
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+	if (!changed && !FL.check) return 0;
+
+	int rows = editorFollowRead();
+	struct stat st;
+	if (FL.check && stat(E.filename, &st) == 0) {
+		if (st.st_ino == FL.ino) {
+			FL.check = FL.ifd == -1;
+		} else {
+			while (editorFollowRead()) {} // what was written before the switch comes first
+			if (editorFollowOpen() == 0) {
+				editorSetStatusMessage("%s was replaced, following the new file", E.filename);
+				FL.check = FL.ifd == -1;
+				rows |= editorFollowRead();
 			}
 		}
-		close(fd);
 	}
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	return rows;
+}
+
+/*
+ * Shows the file and follows it from then on, the cursor on the last row
+ */
+void editorFollow(char *filename) {
+	E.filename = strdup(filename);
+	editorSelectSyntaxHighlight();
+
+	FL.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (editorFollowOpen() == -1) die(filename);
+	while (editorFollowRead()) {}
+	FL.check = FL.ifd == -1;
+}
+
+/*
+ * Shows what comes from fd as it comes, without a file name
+ */
+void editorStream(int fd) {
+	FL.fd = fd;
+	FL.stream = 1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 }
 
 /*** find ***/
@@ -700,13 +3717,18 @@ void editorFindCallback(char *query, int key) {
 	static int last_match = -1; // -1 no match, otherwise index of the row of the match
 	static int direction = 1; 	//direction of the search: 1 forward, -1 backward
 
-	static int saved_hl_line;
-	static char* saved_hl = NULL;
-
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
+	static int saved_hl_line = -1;
+	static hlspan *saved_hl = NULL;
+	static int saved_nhl = 0;
+
+	if (saved_hl_line != -1) {
+		erow *row = &E.row[saved_hl_line];
+		rsFree(row->hl, MEM_HL);
+		rsRetag(saved_hl, MEM_SEARCH, MEM_HL);
+		row->hl = saved_hl;
+		row->nhl = saved_nhl;
+		if (row->ll) row->ll->win_valid = 0; // the window may have moved since
+		saved_hl_line = -1;
 	}
 
 	if (key == '\r' || key == '\x1b') {
@@ -734,24 +3756,47 @@ void editorFindCallback(char *query, int key) {
 		else if (current == E.numrows)  current = 0; // wrap forward
 
 		erow *row = &E.row[current];
-		char *match = strstr(row->render, query);
+		// long rows have no full render to search
+		char *match = strstr(row->ll ? row->chars : row->render, query);
 
 		if (match) {
+			int match_rx, match_cx;
+			if (row->ll) {
+				match_cx = match - row->chars;
+				match_rx = editorRowCxToRx(row, match_cx);
+			} else {
+				match_rx = match - row->render;
+				match_cx = editorRowRxToCx(row, match_rx);
+			}
 			last_match = current;
 			E.cy = current; 
-			E.cx = editorRowRxToCx(row, match - row->render);
+			E.cx = match_cx;
 			E.rowoff = E.numrows;
 
+			int match_len = strlen(query);
+			if (row->ll) {
+				match_len = editorRowCxToRx(row, match_cx + match_len) - match_rx;
+				editorLongWindow(row, match_rx, match_len);
+			}
+
+			// the row gets new spans with the match, the original ones are kept aside
+			editorRowHighlight(row);
+			unsigned char *hl = editorHlScratch(row->rsize);
+			editorRowSpansToHl(row, hl);
+			memset(&hl[match_rx - editorRowRoff(row)], HL_MATCH, match_len);
 			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+			saved_hl = row->hl;
+			saved_nhl = row->nhl;
+			rsRetag(saved_hl, MEM_HL, MEM_SEARCH);
+			row->hl = NULL;
+			editorRowSetSpans(row, hl, editorRowRoff(row), row->rsize);
 			break;
 		}
 	}
 }
 
 void editorFind() {
+	editorFilterEnd(); // a match can be anywhere
 	int saved_cx = E.cx;
 	int saved_cy = E.cy;
 	int saved_coloff = E.coloff;
@@ -772,6 +3817,333 @@ void editorFind() {
 	}
 }
 
+/*** filter ***/
+
+/*
+ * The filtered view shows only the rows that contain a query, like grep.
+ * It is an array of row indexes, not a copy of the rows: the screen, the
+ * cursor moves and the status bar go through it, and E.cy stays the index
+ * of a real row, so leaving the view puts the cursor back in the file at
+ * once. The array is built while the keys are waited for, a slice of rows
+ * at a time, by a thread for every core.
+ */
+
+struct filterView FV = {0, NULL, 0, NULL, 0, 0, 0};
+
+struct filterSlice {
+	pthread_t thread;
+	int from, to; 	// rows
+	int *rows; 		// those that match
+	int n;
+	int failed; 	// rows could not grow: the matches are not all there
+};
+
+void *filterScan(void *arg) {
+	struct filterSlice *sl = arg;
+	int cap = 0;
+	sl->rows = NULL;
+	sl->n = 0;
+	sl->failed = 0;
+	for (int j = sl->from; j < sl->to; j++) {
+		erow *row = &E.row[j];
+		if (!memmem(row->chars, row->size, FV.query, FV.qlen)) continue;
+		if (sl->n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			int *rows = realloc(sl->rows, sizeof(int) * cap);
+			if (rows == NULL) { // the main thread dies for it, see editorFilterStep
+				sl->failed = 1;
+				break;
+			}
+			sl->rows = rows;
+		}
+		sl->rows[sl->n++] = j;
+	}
+	return NULL;
+}
+
+/*
+ * Looks at the next KILO_FILTER_SLICE rows, and returns whether the view
+ * changed. The rows are split between the threads, their matches are put
+ * in order after the ones found so far.
+ */
+int editorFilterStep() {
+	if (!FV.active || FV.scanned >= E.numrows) return 0;
+
+	int from = FV.scanned, to = E.numrows;
+	if (to - from > KILO_FILTER_SLICE) to = from + KILO_FILTER_SLICE;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > KILO_FILTER_THREADS) nthreads = KILO_FILTER_THREADS;
+	if (nthreads > (to - from) / 4096) nthreads = (to - from) / 4096;
+	if (nthreads < 1) nthreads = 1;
+
+	struct filterSlice sl[KILO_FILTER_THREADS];
+	for (int t = 0; t < nthreads; t++) {
+		sl[t].from = from + (long long)(to - from) * t / nthreads;
+		sl[t].to = from + (long long)(to - from) * (t + 1) / nthreads;
+		if (t == 0 || pthread_create(&sl[t].thread, NULL, filterScan, &sl[t]) != 0)
+			sl[t].thread = 0;
+	}
+	filterScan(&sl[0]); // the first slice is this thread's
+	for (int t = 0; t < nthreads; t++) {
+		if (t > 0 && sl[t].thread) pthread_join(sl[t].thread, NULL);
+		else if (t > 0) filterScan(&sl[t]); // no thread for it
+		if (sl[t].failed) die("realloc");
+	}
+
+	int found = FV.n;
+	for (int t = 0; t < nthreads; t++) {
+		if (FV.n + sl[t].n > FV.cap) {
+			while (FV.n + sl[t].n > FV.cap) FV.cap = FV.cap ? FV.cap * 2 : 1024;
+			FV.rows = rsRealloc(FV.rows, sizeof(int) * FV.cap, MEM_SEARCH);
+		}
+		memcpy(&FV.rows[FV.n], sl[t].rows, sizeof(int) * sl[t].n);
+		FV.n += sl[t].n;
+		free(sl[t].rows);
+	}
+	FV.scanned = to;
+
+	if (found == 0 && FV.n > 0) { // the first match is where the cursor starts
+		E.cy = FV.rows[0];
+		E.cx = 0;
+	}
+	return 1;
+}
+
+void editorFilterEnd() {
+	if (!FV.active) return;
+	rsFree(FV.rows, MEM_SEARCH);
+	free(FV.query);
+	FV = (struct filterView){0, NULL, 0, NULL, 0, 0, 0};
+	// the row of the cursor, in the middle of the screen
+	E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+}
+
+/*
+ * Ctrl-E: asks for the query and shows the rows that have it, or goes back
+ * to all the rows, the cursor on the same row
+ */
+void editorFilter() {
+	if (FV.active) {
+		editorFilterEnd();
+		return;
+	}
+	char *query = editorPrompt("Filter: %s (ESC to cancel)", NULL);
+	if (query == NULL || query[0] == '\0') {
+		free(query);
+		return;
+	}
+	FV.active = 1;
+	FV.query = query;
+	FV.qlen = strlen(query);
+	E.rowoff = 0;
+	editorFilterStep(); // the first rows right away, the others while keys are waited for
+}
+
+// the rows on screen: those that match, or all of them
+int editorViewRows() {
+	return FV.active ? FV.n : E.numrows;
+}
+
+// the row at line v of the view
+int editorViewRow(int v) {
+	if (!FV.active) return v;
+	if (FV.n == 0) return E.cy;
+	return FV.rows[v < FV.n ? v : FV.n - 1];
+}
+
+// the line of the view of row y, or of the first row after it
+int editorViewOf(int y) {
+	if (!FV.active) return y;
+	int lo = 0, hi = FV.n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (FV.rows[mid] < y) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// the row dir lines after row y in the view, y itself at its ends
+int editorViewStep(int y, int dir) {
+	if (!FV.active) {
+		y += dir;
+		return y < 0 ? 0 : y > E.numrows ? E.numrows : y;
+	}
+	int v = editorViewOf(y) + dir;
+	if (v < 0 || v >= FV.n) return y;
+	return FV.rows[v];
+}
+
+/*** pipe ***/
+
+/*
+ * Ctrl-P runs a shell command with rows as its input and puts its output in
+ * their place, like sort or jq over a region. The rows are written to the
+ * command straight from the row store while its output is read, both
+ * without blocking, so a command that answers before it has read all its
+ * input can't get stuck. The replacement is a single undo group.
+ */
+
+struct pipeJob {
+	int y, x; 		// the next byte written, x == size is the newline
+	int end; 		// the row after the last one written
+	struct abuf out;
+};
+
+// writes what the pipe takes without blocking, 0 once all is written
+int pipeWrite(struct pipeJob *job, int fd) {
+	while (job->y < job->end) {
+		struct iovec iov[64];
+		int n = 0;
+		for (int y = job->y, x = job->x; y < job->end && n < 62; y++, x = 0) {
+			erow *row = &E.row[y];
+			if (x < row->size) iov[n++] = (struct iovec){&row->chars[x], row->size - x};
+			iov[n++] = (struct iovec){"\n", 1};
+		}
+		ssize_t nwritten = writev(fd, iov, n);
+		if (nwritten == -1) return errno == EAGAIN || errno == EINTR ? 1 : -1;
+		while (nwritten > 0) { // move past what was taken
+			int left = E.row[job->y].size - job->x + 1;
+			if (nwritten < left) {
+				job->x += nwritten;
+				break;
+			}
+			nwritten -= left;
+			job->y++;
+			job->x = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pipes rows [from, to) through the command and returns its exit status,
+ * -1 when it could not run or ESC stopped it. The output goes to job->out.
+ */
+int editorPipeRun(const char *cmd, int from, int to, struct pipeJob *job) {
+	int in[2], out[2];
+	if (pipe2(in, O_CLOEXEC) == -1) return -1;
+	if (pipe2(out, O_CLOEXEC) == -1) {
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		setpgid(0, 0); // ESC stops the whole pipeline, see below
+		signal(SIGPIPE, SIG_DFL); // the editor ignores it, "yes | head" must not
+		int null = open("/dev/null", O_WRONLY);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		if (null != -1) dup2(null, STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	if (pid == -1) {
+		close(in[1]);
+		close(out[0]);
+		return -1;
+	}
+	setpgid(pid, pid); // the child may not have got there yet
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+	*job = (struct pipeJob){from, 0, to, ABUF_INIT};
+	int wfd = in[1], stopped = 0;
+	char buf[65536];
+	while (out[0] != -1 && !stopped) {
+		struct pollfd fds[3] = {{out[0], POLLIN, 0}, {E.ifd, POLLIN, 0}, {wfd, POLLOUT, 0}};
+		if (poll(fds, wfd == -1 ? 2 : 3, -1) == -1 && errno != EINTR) break;
+		if (fds[1].revents) {
+			char c;
+			if (read(E.ifd, &c, 1) == 1 && c == '\x1b') stopped = 1;
+		}
+		if (wfd != -1 && fds[2].revents && pipeWrite(job, wfd) != 1) {
+			close(wfd); // all written, or the command does not read any more
+			wfd = -1;
+		}
+		if (fds[0].revents) {
+			ssize_t nread;
+			while ((nread = read(out[0], buf, sizeof(buf))) > 0) abAppend(&job->out, buf, nread);
+			if (nread == 0 || (nread == -1 && errno != EAGAIN && errno != EINTR)) {
+				close(out[0]);
+				out[0] = -1;
+			}
+		}
+	}
+	if (wfd != -1) close(wfd);
+	if (out[0] != -1) close(out[0]);
+	if (stopped) kill(-pid, SIGTERM);
+
+	// the command can go on after closing its output, so ESC still works
+	// while it is waited for, and a command that ignores SIGTERM gets a
+	// SIGKILL after KILO_PIPE_GRACE ms
+	int status, waited = 0;
+	pid_t done;
+	while ((done = waitpid(pid, &status, WNOHANG)) == 0) {
+		struct pollfd fds = {E.ifd, POLLIN, 0};
+		if (poll(&fds, stopped ? 0 : 1, 10) > 0) {
+			char c;
+			if (read(E.ifd, &c, 1) == 1 && c == '\x1b') {
+				stopped = 1;
+				kill(-pid, SIGTERM);
+			}
+		}
+		if (stopped && (waited += 10) >= KILO_PIPE_GRACE) kill(-pid, SIGKILL);
+	}
+	if (done == -1 || stopped) return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * Asks for the command, with the rows it works on in front as in
+ * "10,200!sort", all the rows otherwise
+ */
+void editorPipe() {
+	if (editorReadOnly()) return;
+	char *cmd = editorPrompt("Pipe through: %s (from,to!command, ESC to cancel)", NULL);
+	if (cmd == NULL) return;
+
+	int from = 0, to = E.numrows, first, last, n = 0;
+	char *run = cmd;
+	if (sscanf(cmd, " %d , %d !%n", &first, &last, &n) == 2 && n > 0) {
+		if (first < 1) first = 1;
+		if (last > E.numrows) last = E.numrows;
+		from = first - 1;
+		to = last;
+		run = cmd + n;
+	}
+	if (from >= to || *run == '\0') {
+		editorSetStatusMessage("No rows to pipe");
+		free(cmd);
+		return;
+	}
+
+	editorSetStatusMessage("Running %.40s on %d rows... (ESC stops it)", run, to - from);
+	editorRefreshScreen();
+	struct pipeJob job;
+	int status = editorPipeRun(run, from, to, &job);
+	if (status != 0) {
+		if (status == -1) editorSetStatusMessage("%.40s did not run to the end, the rows are kept", run);
+		else editorSetStatusMessage("%.40s failed with status %d, the rows are kept", run, status);
+	} else {
+		struct diskLines dl = {job.out.b, 0, NULL, NULL};
+		diskLinesSplit(&dl, job.out.len);
+		struct diffHunk h = {from, to, 0, dl.n};
+		editorUndoBegin();
+		editorReplaceRows(&dl, &h);
+		editorUndoEnd();
+		if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+		editorSetStatusMessage("%d rows became %d through %.40s", to - from, dl.n, run);
+		free(dl.off);
+		free(dl.len);
+	}
+	abFree(&job.out);
+	free(cmd);
+}
+
 /*** input ***/
 
 char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
@@ -788,7 +4160,9 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
 		int c = editorReadKey();
 
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-			if (buflen != 0) buf[--buflen] = '\0';
+			// a whole UTF-8 char goes
+			while (buflen != 0 && ((unsigned char)buf[--buflen] & 0xc0) == 0x80);
+			buf[buflen] = '\0';
 		} else if (c == '\x1b') {
 			editorSetStatusMessage("");
 			if (callback) callback(buf, c);
@@ -800,7 +4174,7 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
 				if (callback) callback(buf, c);
 				return buf;
 			}
-		} else if (!iscntrl(c) && c < 128) { //check it's not a special key
+		} else if (c >= 32 && c < 256 && c != 127) { //check it's not a special key
 			if (buflen == bufsize -1) {
 				bufsize *= 2;
 				buf = realloc(buf, bufsize);
@@ -822,39 +4196,40 @@ void editorMoveCursor(int key) {
 	switch (key) {
 		case ARROW_LEFT:
 			if (E.cx != 0)	{
-				E.cx--;
+				E.cx = editorRowPrevChar(row, E.cx);
 			}
-			else if (E.cy > 0) {
-				E.cy--;
+			else if (editorViewStep(E.cy, -1) != E.cy) {
+				E.cy = editorViewStep(E.cy, -1);
 				E.cx = E.row[E.cy].size;
 			}
 			break;
 		case ARROW_RIGHT:
 			if (row && E.cx < row->size) { 
-				E.cx++;
-			} else if (row && E.cx == row->size) {
-				E.cy++;
+				E.cx = editorRowNextChar(row, E.cx);
+			} else if (row && E.cx == row->size && editorViewStep(E.cy, 1) != E.cy) {
+				E.cy = editorViewStep(E.cy, 1);
 				E.cx = 0;
 			}
 			break;
 		case ARROW_UP:
-			if (E.cy != 0) E.cy--;
+			E.cy = editorViewStep(E.cy, -1);
 			break;
 		case ARROW_DOWN:
-			if (E.cy < E.numrows) {
-				E.cy++;
-			}			
+			E.cy = editorViewStep(E.cy, 1);
 			break;			
 	}
 	row = getCurrentRow();
 	int rowlen = row ? row->size : 0;
 	if (E.cx > rowlen) E.cx = rowlen;
+	if (row) E.cx = editorRowCharStart(row, E.cx);
 }
 
 void editorProcessKeypress() {
 	static int quit_times = KILO_QUIT_TIMES;
 
 	int c = editorReadKey();
+	// prompts read more keys: the time spent waiting for them does not count
+	double start = timingNow(), waited = FT.waited;
 	switch (c) {
 		case '\r': 
 			editorInsertNewline();
@@ -864,8 +4239,10 @@ void editorProcessKeypress() {
 				editorSetStatusMessage("Warning! File has unsaved changes. " 
 					"Press Ctrl-Q %d more times to quit.", quit_times);
 				quit_times--;
+				timingAdd(TM_KEY, start, timingNow() - start - (FT.waited - waited));
 				return;
 			}	
+			editorSwapClose(); // the changes not saved are dropped on purpose
 			editorClearScreen();
 			exit(0);
 			}
@@ -879,15 +4256,14 @@ void editorProcessKeypress() {
 		case PAGE_UP:			
 		case PAGE_DOWN:
 			{
-				if (c == PAGE_UP) {
-					E.cy = E.rowoff;
-				}
-				else if (c == PAGE_DOWN) {
-					E.cy = E.rowoff + E.screenrows - 1;
-					if (E.cy > E.numrows) E.cy = E.numrows;
-				}
-				int times = E.screenrows;
-				while (times--) editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+				// a screen past the first or the last row on it
+				int v = c == PAGE_UP ? E.rowoff - E.screenrows : E.rowoff + 2 * E.screenrows - 1;
+				int last = FV.active ? editorViewRows() - 1 : E.numrows;
+				if (v > last) v = last;
+				if (v < 0) v = 0;
+				E.cy = editorViewRow(v);
+				erow *row = getCurrentRow();
+				if (E.cx > (row ? row->size : 0)) E.cx = row ? row->size : 0;
 			}
 			break;
 		case HOME_KEY:
@@ -919,11 +4295,49 @@ void editorProcessKeypress() {
 			editorFind();
 			break;
 
+		case CTRL_KEY('k'):
+			{
+				char stats[sizeof(E.statusmsg)];
+				editorMemStats(stats, sizeof(stats));
+				editorSetStatusMessage("%s", stats);
+			}
+			break;
+
+		case CTRL_KEY('t'):
+			FT.overlay = !FT.overlay;
+			break;
+
+		case CTRL_KEY('z'):
+			editorUndo();
+			break;
+
+		case CTRL_KEY('y'):
+			editorRedo();
+			break;
+
+		case CTRL_KEY('r'):
+			editorReload();
+			break;
+
+		case CTRL_KEY('e'):
+			editorFilter();
+			break;
+
+		case CTRL_KEY('p'):
+			editorPipe();
+			break;
+
+		case CTRL_KEY('g'):
+			editorGoto();
+			break;
+
 		default:
 			editorInsertChar(c);
 			break;		
 	}
 	quit_times = KILO_QUIT_TIMES;
+	editorMemBudget();
+	timingAdd(TM_KEY, start, timingNow() - start - (FT.waited - waited));
 }
 
 /*** output ***/
@@ -931,13 +4345,16 @@ void editorProcessKeypress() {
 void editorScroll() {
 	E.rx = 0;
 	if (E.cy < E.numrows) {
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		erow *row = &E.row[E.cy];
+		E.cx = editorRowCharStart(row, E.cx); // never in the middle of a char
+		E.rx = editorRowRxToCol(row, editorRowCxToRx(row, E.cx));
 	}	
-	if (E.cy < E.rowoff) {
-		E.rowoff = E.cy;
+	int vy = editorViewOf(E.cy);
+	if (vy < E.rowoff) {
+		E.rowoff = vy;
 	}
-	if (E.cy >= E.rowoff + E.screenrows) {
-		E.rowoff = E.cy - E.screenrows + 1;
+	if (vy >= E.rowoff + E.screenrows) {
+		E.rowoff = vy - E.screenrows + 1;
 	}
 
 	if (E.rx < E.coloff) {
@@ -949,12 +4366,49 @@ void editorScroll() {
 	}
 }
 
+/*
+ * Appends len render chars that share the highlight hl, copying them in bulk
+ * up to the next control character or byte above 127. A UTF-8 char that
+ * can be printed is copied too, anything else is shown inverted.
+ */
+void editorDrawRun(struct abuf *ab, char *c, int len, int hl) {
+	char color[16];
+	int clen;
+	if (hl == HL_NORMAL) 
+		clen = snprintf(color, sizeof(color), "\x1b[39m");
+	else
+		clen = snprintf(color, sizeof(color), "\x1b[38;5;%dm", editorSyntaxToColor(hl)); //https://en.wikipedia.org/wiki/ANSI_escape_code#Colors
+	abAppend(ab, color, clen);
+
+	int j = 0;
+	while (j < len) {
+		int k = j;
+		while (k < len && (unsigned char)c[k] >= 32 && (unsigned char)c[k] < 127) k++;
+		abAppend(ab, &c[j], k - j);
+		if (k == len) break;
+
+		int n = 1;
+		if ((unsigned char)c[k] >= 0x80 && editorCharWidth(&c[k], len - k, &n) >= 0) {
+			abAppend(ab, &c[k], n);
+			j = k + n;
+			continue;
+		}
+		// to print an A for Ctrl+A we add the value of the ctrl char to @ that is the char just before capitals letter in ASCII 
+		char sym = ((unsigned char)c[k] <= 26) ? '@' + c[k] : '?'; 
+		abAppend(ab, "\x1b[7m", 4);
+		abAppend(ab, &sym, 1);
+		abAppend(ab, "\x1b[m", 3);
+		abAppend(ab, color, clen);
+		j = k + n;
+	}
+}
+
 void editorDrawRows(struct abuf *ab) {
 	int y;
 	for (y = 0; y < E.screenrows; ++y){
 		int filerow = y + E.rowoff;		
 		// if we are after the end of the file
-		if (filerow >= E.numrows) {
+		if (filerow >= editorViewRows()) {
 			// if there are no rows
 			if (E.numrows == 0 && y == E.screenrows / 3) {
 				char welcome[80];
@@ -972,45 +4426,38 @@ void editorDrawRows(struct abuf *ab) {
 			}
 		}
 		else {
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-			if (len > E.screencols) len = E.screencols;
-
-			
-			char *c  =  &E.row[filerow].render[E.coloff];
-			unsigned char *hl =  &E.row[filerow].hl[E.coloff];
-			int current_color = HL_NORMAL;
-			int j;
-			for (j = 0; j < len; j++) {
-
-				if (iscntrl(c[j])) {
-					// to print an A for Ctrl+A we add the value of the ctrl char to @ that is the char just before capitals letter in ASCII 
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?'; 
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					abAppend(ab, "\x1b[m", 3);
-					if (current_color != HL_NORMAL) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", current_color);
-						abAppend(ab, buf, clen);
-					}
+			erow *row = &E.row[editorViewRow(filerow)];
+			editorRowHighlight(row);
+			// the render chars on screen: columns in ASCII rows
+			int pos = E.coloff;
+			int end = E.coloff + E.screencols;
+			if (row->ncols) {
+				pos = E.coloff ? editorRowColToRx(row, E.coloff) : 0;
+				if (editorRowRxToCol(row, pos) < E.coloff) { // half of a wide char
+					abAppend(ab, " ", 1);
+					pos = editorRowColToRx(row, E.coloff + 1);
 				}
-				else if (hl[j] == HL_NORMAL) {
-					if (current_color != HL_NORMAL) {
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = HL_NORMAL;
-					}
-					abAppend(ab, &c[j], 1);
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (current_color != color) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", color);
-						abAppend(ab, buf, clen); //https://en.wikipedia.org/wiki/ANSI_escape_code#Colors						
-						current_color = color;
-					}	
-					abAppend(ab, &c[j], 1);				
+				end = editorRowColToRx(row, E.coloff + E.screencols);
+			}
+			if (row->ll) editorLongWindow(row, pos, end - pos);
+			int roff = editorRowRoff(row);
+			if (end > roff + row->rsize) end = roff + row->rsize;
+
+			// one color change and one bulk copy per highlight span
+			int s = editorRowSpanAt(row, pos);
+			while (pos < end) {
+				int runend = end;
+				int hl = HL_NORMAL;
+				if (s < row->nhl && row->hl[s].start <= pos) {
+					hl = row->hl[s].hl;
+					if (row->hl[s].start + row->hl[s].len < runend) 
+						runend = row->hl[s].start + row->hl[s].len;
+					s++;
+				} else if (s < row->nhl && row->hl[s].start < runend) {
+					runend = row->hl[s].start;
 				}
+				editorDrawRun(ab, &row->render[pos - roff], runend - pos, hl);
+				pos = runend;
 			}
 			abAppend(ab, "\x1b[39m", 5);
 			
@@ -1027,15 +4474,25 @@ void editorDrawStatusBar(struct abuf *ab) {
 	abAppend(ab, "\x1b[7m", 4); //invert colors
 	
 	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-		E.filename ? E.filename : "[No name]", E.numrows,
-		E.dirty > 0 ? "(modified)" : "");
+	long long off = editorRowOffset(E.cy) + (E.cy < E.numrows ? E.cx : 0);
+	int len;
+	if (FV.active) {
+		len = snprintf(status, sizeof(status), "%.20s - %d of %d lines have \"%.20s\"%s",
+			E.filename ? E.filename : "[No name]", FV.n, FV.scanned, FV.query,
+			FV.scanned < E.numrows ? "..." : "");
+	} else {
+		len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+			E.filename ? E.filename : "[No name]", E.numrows,
+			FL.fd != -1 ? (FL.stream ? "(reading)" : "(following)") : E.dirty > 0 ? "(modified)" : "");
+	}
+	if (len > (int)sizeof(status) - 1) len = sizeof(status) - 1;
 
 
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | @%lld",
 						E.syntax ? E.syntax->filetype : "no ft", 
 						E.cy + 1, 
-						E.numrows);
+						E.numrows,
+						off);
 
 	abAppend(ab, status, len);
 
@@ -1053,6 +4510,14 @@ void editorDrawStatusBar(struct abuf *ab) {
 
 void editorDrawMessageBar(struct abuf *ab) {
 	abAppend(ab, "\x1b[K", 3); //clear the line
+	if (FT.overlay) {
+		char stats[160];
+		int len = timingStats(stats, sizeof(stats));
+		if (len > (int)sizeof(stats) - 1) len = sizeof(stats) - 1;
+		if (len > E.screencols) len = E.screencols;
+		abAppend(ab, stats, len);
+		return;
+	}
 	int msglen = strlen(E.statusmsg);
 	if (msglen > E.screencols) msglen = E.screencols;
 	if (msglen && time(NULL) - E.statusmsg_time < 5) {
@@ -1064,26 +4529,33 @@ void editorDrawMessageBar(struct abuf *ab) {
 
 void editorRefreshScreen() {	
 
+	double start = timingNow();
 	editorScroll();
+	timingAdd(TM_SCROLL, start, timingNow() - start);
 
 	struct abuf ab = ABUF_INIT;
 
 	abAppend(&ab, "\x1b[?25l", 6); //hide the cursors
 	abAppend(&ab, "\x1b[H", 3);
 
+	start = timingNow();
 	editorDrawRows(&ab);
+	timingAdd(TM_DRAW, start, timingNow() - start);
 	editorDrawStatusBar(&ab);
 	editorDrawMessageBar(&ab);
 
 	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, 
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editorViewOf(E.cy) - E.rowoff) + 1, 
 											  (E.rx - E.coloff) + 1);
 	abAppend(&ab, buf, strlen(buf));
 
 	
 	abAppend(&ab, "\x1b[?25h", 6); //show the cursor
 
-	write(STDOUT_FILENO, ab.b, ab.len);
+	start = timingNow();
+	write(E.ofd, ab.b, ab.len);
+	timingAdd(TM_WRITE, start, timingNow() - start);
+	timingAdd(TM_BYTES, start, ab.len);
 	abFree(&ab);
 }
 
@@ -1098,8 +4570,8 @@ void editorSetStatusMessage(const char * format, ...) {
 
 void editorClearScreen() {
 	
-	write(STDOUT_FILENO, "\x1b[2J", 4); //erase in display http://vt100.net/docs/vt100-ug/chapter3.html#ED
-	write(STDOUT_FILENO, "\x1b[H", 3); //reposition cursor to top first row, first col: http://vt100.net/docs/vt100-ug/chapter3.html#CUP
+	write(E.ofd, "\x1b[2J", 4); //erase in display http://vt100.net/docs/vt100-ug/chapter3.html#ED
+	write(E.ofd, "\x1b[H", 3); //reposition cursor to top first row, first col: http://vt100.net/docs/vt100-ug/chapter3.html#CUP
 }
 
 /*** init ***/
@@ -1112,44 +4584,22 @@ void initEditor() {
 	E.coloff = 0;
 	E.numrows = 0;
 	E.row = 0;
+	LX.valid = 0;
 	E.dirty = 0;
 	E.filename = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
-
-
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-	E.screenrows -= 2; // reduce the number of shown rows to add space for status bar
-	
-
-}
-
-int main(int argc, char *argv[]) {
-	
-	enableRawMode();
-	initEditor();
-	if (argc >= 2)
-		editorOpen(argv[1]);
-	
-	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-Q = quit");
-
-	while (1) {
-		editorRefreshScreen();
-		editorProcessKeypress();
-		/*char c = '\0';
-		
-		if (iscntrl(c)) {
-			printf("%d\r\n", c);
-		}
-		else {
-			printf("%d ('%c')\r\n", c, c);
-		}
-		if (c == CTRL_KEY('q')) break;*/
-		
-	}
-	return 0;
+	E.mem_budget = 0;
+	E.disk_changed = 0;
+	E.compressor = NULL;
+	E.cache_min = 0;
+	E.hl_stale = -1;
+	signal(SIGPIPE, SIG_IGN); // a child that stops reading early is an error, not the end of the editor
+	editorUndoClear();
+	UJ.limit = KILO_UNDO_LIMIT;
+	E.ifd = STDIN_FILENO;
+	E.ofd = STDOUT_FILENO;
+	E.screenrows = 24 - 2; // until the caller knows better
+	E.screencols = 80;
 }
-
-
-
@@ -0,0 +1,565 @@
+/**
+ * Kilo editor, in c: the editor core.
+ *
+ * Rows, editing, syntax highlighting, search and save live in kilo.c and
+ * work on the global E. They never need a tty: keys are read from E.ifd and
+ * the screen is written to E.ofd, so the same core runs the terminal editor
+ * (main.c) and the benchmarks (bench.c).
+ */
+
+#ifndef KILO_H
+#define KILO_H
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <time.h>
+
+/*** defines ***/
+
+#define KILO_VERSION "0.0.1"
+#define KILO_TAB_STOP 4
+#define KILO_QUIT_TIMES 3
+#define KILO_LONG_LINE (64 * 1024) 	// rows longer than this are rendered one window at a time
+#define KILO_LONG_CHUNK (64 * 1024) // distance between two highlighter checkpoints
+#define KILO_LONG_MARGIN 4096 		// render chars kept on both sides of the screen in a window
+#define KILO_LONG_LOOKAHEAD 64 		// how far the highlighter may look past a token
+#define KILO_UNDO_LIMIT (8 << 20) 	// bytes of undo history kept by default
+#define KILO_UNDO_PAUSE 1e6 		// us: edits closer than this can share an undo record
+#define KILO_SWAP_SYNC 1e6 		// us: the swap file reaches the disk at most this late
+#define KILO_DIFF_WINDOW 64 		// rows a reload looks ahead for the end of a change
+#define KILO_DIFF_RUN 4 		// equal rows that end a change
+#define KILO_FILTER_SLICE (1 << 20) 	// rows a filtered view looks at between two key waits
+#define KILO_FILTER_THREADS 8 		// at most
+#define KILO_PIPE_GRACE 1000 		// ms a stopped pipe command has to exit before it is killed
+#define KILO_FOLLOW_BATCH (8 << 20) 	// bytes a followed file can grow by in one poll
+#define KILO_SWAP_MAGIC "KILOSWP1"
+#define KILO_CACHE_MAGIC "KILOIDX1"
+#define KILO_SYNTAX_MAGIC "KILOSYN1"
+#define KILO_TIMING_FRAMES 128 	// samples the timing overlay computes its percentiles over
+
+#define CTRL_KEY(k) ((k) & 0x1f)
+
+enum editorKey {
+	BACKSPACE = 127,
+	ARROW_LEFT = 1000,
+	ARROW_RIGHT,
+	ARROW_UP,
+	ARROW_DOWN,
+	PAGE_UP,
+	PAGE_DOWN,
+	HOME_KEY,
+	END_KEY,
+	DEL_KEY
+};
+
+enum editorHiglight {
+	HL_NORMAL = 0,
+	HL_STRING,
+	HL_NUMBER,
+	HL_MATCH,  //search match
+	HL_COMMENT,
+	HL_MLCOMMENT,
+	HL_KEYWORD1,
+	HL_KEYWORD2
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
+/*** data ***/
+
+/*
+ * A run of render characters sharing the same highlight. Only runs that are
+ * not HL_NORMAL are stored, anything between two spans is normal text.
+ */
+typedef struct hlspan {
+	int start;
+	int len;
+	unsigned char hl;
+} hlspan;
+
+/*
+ * Position of an irregular char, in chars (cx) and in render (rx)
+ */
+typedef struct rxmark {
+	int cx;
+	int rx;
+} rxmark;
+
+/*
+ * Position of a render char that does not take exactly one screen column:
+ * a UTF-8 sequence, or a byte that is not part of one
+ */
+typedef struct colmark {
+	int rx;
+	int col;
+	unsigned char len; 		// bytes
+	unsigned char width; 	// columns: 0 for combining marks, 2 for wide chars
+} colmark;
+
+/*
+ * Everything the highlighter needs to resume from the middle of a row
+ */
+typedef struct hlState {
+	int in_string; 	// the quote char of the open string, 0 outside strings
+	int in_comment; // inside a MULTILINE comment
+	int in_line_comment;
+	int prev_sep;
+	int prev_hl; 	// highlight of the previous char
+} hlState;
+
+typedef struct hlCheckpoint {
+	int cx;
+	hlState st;
+	int edited; 	// the chars before it changed since it was computed
+} hlCheckpoint;
+
+/*
+ * Extra state of the rows longer than KILO_LONG_LINE, see editorLongCheckpoint
+ */
+typedef struct longRow {
+	hlCheckpoint *checks; 	// checks[0] is the beginning of the row
+	int nchecks;
+	int nsure; 				// the ones after were computed before an edit
+	int capchecks;
+	hlState end; 			// state at the end of the row, if end_valid
+	int end_valid;
+	int roff; 				// render position of the window
+	int cx0, cx1; 			// chars the window was built from
+	int win_valid;
+} longRow;
+
+typedef struct erow {
+	int idx;
+	int size;
+	int rsize;
+	char *chars;
+	char *render;
+	hlspan *hl; 	// highlight: the runs of render that are part of a string, a comment, a number, ect
+	int nhl; 		// -1 until the row is highlighted, see editorRowHighlight
+	int ncols; 		// colmarks, kept after the marks: 0 when the row is all ASCII
+	rxmark *marks; 	// every char that does not take exactly one render column, sorted: 
+	int nmarks; 	// cx <-> rx conversions binary search them instead of walking the row
+	int hl_open_comment;
+	longRow *ll; 	// NULL unless the row is long: then render and hl only cover a window
+} erow;
+
+struct editorConfig {
+	int cx, cy;
+	int rx;
+	int rowoff;
+	int coloff;
+	int screenrows;
+	int screencols;
+	int numrows;
+	int dirty; /* file modified but saved */
+	erow *row;
+	char *filename;
+	char statusmsg[128];
+	time_t statusmsg_time;
+	struct editorSyntax *syntax;
+	struct termios orig_termios;
+	size_t mem_budget; 	// bytes, 0 for no budget: see editorMemBudget
+	int disk_changed; 	// the file changed on disk since it was opened or saved, 2 once told at save
+	struct editorCompressor *compressor; // the file is saved with it, NULL for plain text
+	size_t cache_min; 	// files at least this big get an index cache, 0 for none
+	int ifd; 	// keys are read from here
+	int ofd; 	// and the screen is written here
+	int hl_stale; 	// row after a long row whose end state is not known yet, -1 for none
+};
+
+struct editorCompressor {
+	char *program; 		// run with -dc to decompress, with -c to compress
+	char *ext; 			// a new file with this extension is saved compressed
+	char *magic; 		// the first bytes of a compressed file
+	int magic_len;
+};
+
+/*
+ * A syntax as it is written, built in or in a file of the syntax directory.
+ * The keywords ending with a pipe are the second type of keyword.
+ */
+struct syntaxDef {
+	char *filetype;
+	char **filematch; // array of strings. Each string contains a pattern to match a filename agains.
+	char **keywords;
+	char *singleline_comment_start;
+	char *multiline_comment_start;
+	char *multiline_comment_end;
+	int flags;
+};
+
+/*
+ * A syntax of the syntax table: the strings point inside ST.image
+ */
+struct editorSyntax {
+	char *filetype;
+	char *singleline_comment_start;
+	char *multiline_comment_start;
+	char *multiline_comment_end;
+	int flags;
+	uint32_t *keywords; // hash table of the keywords, see editorSyntaxKeyword
+	uint32_t kwmask; 	// it has kwmask + 1 slots
+};
+
+extern struct editorConfig E;
+
+/*
+ * The syntaxes compiled in one block that is used as is, so it can be
+ * mmapped from a cache file. Offsets are from the start of the block, 0 is
+ * none. The hash tables use linear probing and always have an empty slot.
+ */
+typedef struct syntaxHeader {
+	char magic[8]; 		// KILO_SYNTAX_MAGIC
+	uint64_t stamp; 	// of the definitions it was compiled from
+	uint32_t size; 		// of the whole block
+	uint32_t nsyntax;
+	uint32_t syntaxes; 	// nsyntax syntaxEntry
+	uint32_t extmask;
+	uint32_t exts; 		// extmask + 1 pairs: offset of an extension, index of its syntax
+	uint32_t npatterns;
+	uint32_t patterns; 	// pairs: offset of a pattern matched anywhere in the name, index
+} syntaxHeader;
+
+typedef struct syntaxEntry {
+	uint32_t filetype;
+	uint32_t singleline_comment_start;
+	uint32_t multiline_comment_start;
+	uint32_t multiline_comment_end;
+	uint32_t flags;
+	uint32_t kwmask;
+	uint32_t keywords; 	// kwmask + 1 offsets of keywords, hashed without the pipe
+} syntaxEntry;
+
+struct syntaxTable {
+	char *image; 		// the compiled syntaxes, mmapped from the cache or a malloc, NULL until loaded
+	size_t size;
+	struct editorSyntax *syntaxes;
+};
+
+extern struct syntaxTable ST;
+
+enum changeType {
+	CHANGE_INSERT = 1,
+	CHANGE_DELETE
+};
+
+/*
+ * One change of the undo journal, its len bytes of text follow it
+ */
+typedef struct undoRecord {
+	int type;
+	int reversed; 	// the text is stored backward
+	int y, x; 		// where the text starts
+	int len;
+	unsigned group; // records of a group are undone together
+	unsigned prev; 	// size of the previous record, to walk back
+} undoRecord;
+
+struct undoJournal {
+	char *buf; 		// the records, oldest first
+	size_t cap;
+	size_t len;
+	size_t pos; 	// end of the records done, the ones after it can be redone
+	size_t last; 	// the last record done, when pos is not 0
+	size_t limit; 	// bytes of records kept
+	unsigned group;
+	int grouping; 	// nesting of editorUndoBegin
+	int replaying; 	// changes done by undo and redo are not recorded
+	int coalesce; 	// the next change may extend the last record
+	int end_y, end_x; // where the text of the last insert ends
+	double time; 	// of the last change recorded
+};
+
+extern struct undoJournal UJ;
+
+/*
+ * The swap file starts with the identity of the file its changes apply to,
+ * then has a record for every change, with the text of the inserts.
+ */
+typedef struct swapHeader {
+	char magic[8];
+	uint64_t size;
+	int64_t mtime_ns;
+	uint64_t ino;
+} swapHeader;
+
+typedef struct swapRecord {
+	uint32_t type;
+	uint32_t y, x;
+	uint32_t len;
+} swapRecord;
+
+struct swapFile {
+	int fd; 		// -1 before the first change, -2 when it can't be written
+	char *path;
+	int replaying; 	// changes recovered from the swap file are not written again
+	int unsynced; 	// records written since the last fdatasync
+	double synced; 	// when
+	swapHeader base; // the file as it was opened or saved
+};
+
+extern struct swapFile SW;
+
+/*
+ * The index cache of a file starts with its identity, as the swap file,
+ * then has the offset of every row, the size of the file last, and a bit
+ * for every row that ends inside a multiline comment.
+ */
+typedef struct cacheHeader {
+	swapHeader file; 	// with KILO_CACHE_MAGIC
+	uint64_t syntax; 	// hash of the syntax the bits were computed with, 0 for none
+	uint64_t nrows;
+} cacheHeader;
+
+struct followFile {
+	int fd; 		// the followed file, -1 when not following
+	int ifd; 		// inotify, -1 without it: the file is then checked on every poll
+	int wd;
+	int check; 		// the name may belong to another file now
+	int open; 		// the last row has no newline yet
+	int stream; 	// a pipe or the like, read once up to its end
+	pid_t pid; 		// the decompressor writing to the pipe, -1 for none
+	off_t offset; 	// bytes read so far
+	ino_t ino;
+	char *buf; 		// a stream is read here, KILO_FOLLOW_BATCH bytes
+};
+
+extern struct followFile FL;
+
+struct filterView {
+	int active;
+	char *query;
+	int qlen;
+	int *rows; 		// those that have the query, in order
+	int n, cap;
+	int scanned; 	// the rows after these are still to be looked at
+};
+
+extern struct filterView FV;
+
+/*
+ * Fenwick tree over the bytes of the rows, newlines included: the offset of
+ * a row and the row at an offset are both O(log n)
+ */
+struct lineIndex {
+	long long *tree; 	// 1-based, node i sums the rows (i - (i & -i), i]
+	int cap;
+	int valid; 		// nodes up to this one are right, the others are built when asked
+};
+
+extern struct lineIndex LX;
+
+/*
+ * What the memory goes to. Every buffer of the row storage belongs to one
+ * kind, the table and the slack are computed when asked for.
+ */
+enum memKind {
+	MEM_TABLE = 0, 	// E.row
+	MEM_CHARS,
+	MEM_RENDER,
+	MEM_HL,
+	MEM_SEARCH, 	// highlight kept aside while a match is shown
+	MEM_UNDO,
+	MEM_INDEX, 		// marks and long row checkpoints
+	MEM_SLACK, 		// slab memory not handed out
+	MEM_KINDS
+};
+
+#define RS_SLAB_SIZE (64 * 1024)
+#define RS_MIN_SHIFT 4 	// smallest class: 16 bytes
+#define RS_MAX_SHIFT 12	// biggest class: 4KB
+#define RS_CLASSES (RS_MAX_SHIFT - RS_MIN_SHIFT + 1)
+
+struct rsSlab {
+	struct rsSlab *prev, *next; // list of the slabs of this class with free slots
+	void *free; 	// free slots, linked through their first bytes
+	int cls;
+	int draining; 	// being emptied by a compaction, see rsDrain
+	int used; 		// slots handed out
+	int nslots;
+	int bump; 		// offset of the first slot never handed out
+};
+
+#define RS_HDR_SIZE ((sizeof(struct rsSlab) + 15) & ~(size_t)15)
+
+struct rowStorage {
+	struct rsSlab *partial[RS_CLASSES];
+	struct rsSlab *empty[RS_CLASSES]; // one empty slab kept by a class, on its partial list
+	uintptr_t *set; 	// open addressing set with the address of every live slab
+	size_t setcap;
+	size_t nslabs;
+	size_t used_bytes; 	// bytes handed out from slabs
+	size_t released; 	// slabs given back to the OS so far
+	size_t allocs; 		// buffers handed out so far
+	size_t kind_bytes[MEM_KINDS];
+};
+
+extern struct rowStorage RS;
+
+/*
+ * Phases of the main loop, timed on every key and every frame
+ */
+enum timingSeries {
+	TM_DECODE = 0, 	// editorReadKey, from the first byte of the key
+	TM_KEY, 		// editorProcessKeypress, without the time spent waiting for keys
+	TM_SCROLL,
+	TM_DRAW, 		// editorDrawRows
+	TM_WRITE,
+	TM_BYTES, 		// bytes of every write: a size, not a duration
+	TM_SERIES
+};
+
+struct frameTiming {
+	double samples[TM_SERIES][KILO_TIMING_FRAMES]; // rings of the last durations, in us
+	int count[TM_SERIES]; 	// samples so far
+	double waited; 			// us spent waiting for keys so far
+	int overlay; 			// show the figures in place of the message bar
+	FILE *trace; 			// chrome trace events go here when not NULL
+};
+
+extern struct frameTiming FT;
+
+struct abuf {
+	char *b;
+	int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+/*** prototypes ***/
+
+void abAppend(struct abuf *ab, const char *s, int len);
+void abFree(struct abuf *ab);
+
+void *rsAlloc(size_t size, int kind);
+void rsFree(void *p, int kind);
+void *rsRealloc(void *p, size_t size, int kind);
+void rsRetag(void *p, int from, int to);
+int rsDrain();
+void *rsMove(void *p, int kind);
+void rsUndrain();
+
+double timingNow();
+void timingAdd(int series, double start, double dur);
+double timingPercentile(int series, double p);
+int timingStats(char *buf, size_t len);
+int timingTrace(const char *path);
+
+void die(const char *s);
+void enableRawMode();
+int editorReadKey();
+int getWindowSize(int *rows, int *cols);
+
+void editorLongInvalidate(erow *row, int cx, int removed, int added);
+void editorSyntaxInit(const char *dir);
+char *editorSyntaxKeyword(struct editorSyntax *syntax, const char *s, int len);
+void editorUpdateSyntax(erow *row);
+void editorRowHighlight(erow *row);
+void editorHlResolve(int at);
+void editorHlStale(int at);
+void editorSelectSyntaxHighlight();
+
+int editorIsAscii(const char *s, int len);
+int utf8Decode(const char *s, int len, unsigned *cp);
+int editorCharWidth(const char *s, int len, int *clen);
+int editorRowCxToRx(erow *row, int cx);
+int editorRowRxToCx(erow *row, int rx);
+int editorRowRxToCol(erow *row, int rx);
+int editorRowColToRx(erow *row, int col);
+int editorRowNextChar(erow *row, int cx);
+int editorRowPrevChar(erow *row, int cx);
+int editorRowCharStart(erow *row, int cx);
+void editorUpdateRow(erow *row);
+void editorInsertRow(int at, char *s, size_t len);
+void editorDelRow(int at);
+
+void editorIndexFrom(int at);
+void editorIndexRow(erow *row);
+long long editorRowOffset(int y);
+int editorOffsetRow(long long off);
+void editorGoto();
+
+size_t editorMemUsage(size_t *kinds);
+int editorMemStats(char *buf, size_t len);
+void editorMemReclaim();
+void editorMemBudget();
+
+void editorInsertRows(int at, const char *s, size_t len);
+void editorDelRows(int at, int n);
+
+int editorTextEnd(int y, int x, int len, int *y2, int *x2);
+void editorTextCopy(int y, int x, int len, char *dst);
+void editorInsertText(int y, int x, const char *s, int len);
+void editorDeleteText(int y, int x, int len);
+
+void editorSaveCompressed(struct editorCompressor *c, char *buf, int len);
+void editorDiskCheck();
+void editorReload();
+
+int editorReadOnly();
+int editorFollowPoll();
+void editorFollow(char *filename);
+void editorStream(int fd);
+
+int editorFilterStep();
+void editorFilterEnd();
+void editorFilter();
+int editorViewRows();
+int editorViewRow(int v);
+int editorViewOf(int y);
+int editorViewStep(int y, int dir);
+
+void editorPipe();
+
+void editorNoteInsert(int y, int x, const char *s, int len);
+void editorNoteDelete(int y, int x, int len);
+
+void editorSwapWrite(int type, int y, int x, const char *s, int len);
+void editorSwapTick();
+void editorSwapClose();
+void editorSwapRecover();
+
+int editorCacheLoad(int fd);
+void editorCacheWrite();
+
+void editorUndoClear();
+void editorUndoInsert(int y, int x, const char *s, int len);
+void editorUndoDelete(int y, int x, int len);
+void editorUndoBegin();
+void editorUndoEnd();
+void editorUndo();
+void editorRedo();
+
+void editorInsertChar(int c);
+void editorInsertNewline();
+void editorDelChar();
+
+char* editorRowsToString(int *buflen);
+void editorOpen(char *filename);
+void editorSave();
+uint64_t editorLineHash(const char *s, int len);
+
+void editorFindCallback(char *query, int key);
+void editorFind();
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorMoveCursor(int key);
+void editorProcessKeypress();
+
+void editorScroll();
+void editorDrawRows(struct abuf *ab);
+void editorRefreshScreen();
+void editorSetStatusMessage(const char * format, ...);
+void editorClearScreen();
+
+void initEditor();
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * Kilo editor, in c: the terminal front end.
+ *
+ * Everything but the tty handling lives in the editor core, see kilo.h.
+ */
+
+#include "kilo.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <locale.h>
+#include <langinfo.h>
+
+// bytes, or with a K, M or G suffix
+size_t parseSize(const char *s) {
+	char *unit;
+	size_t size = strtoull(s, &unit, 10);
+	switch (*unit) {
+		case 'G': case 'g': size <<= 10; // fall through
+		case 'M': case 'm': size <<= 10; // fall through
+		case 'K': case 'k': size <<= 10;
+	}
+	return size;
+}
+
+int main(int argc, char *argv[]) {
+	// the text is read as UTF-8, and the widths of its chars come from the locale
+	if (!setlocale(LC_CTYPE, "") || strcmp(nl_langinfo(CODESET), "UTF-8"))
+		setlocale(LC_CTYPE, "C.UTF-8");
+	
+	initEditor();
+	int stream = argc >= 2 && !strcmp(argv[1], "-");
+	if (stream) { // the text comes from stdin, the keys from the terminal
+		E.ifd = open("/dev/tty", O_RDWR);
+		if (E.ifd == -1) die("/dev/tty");
+	}
+	enableRawMode();
+	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+	E.screenrows -= 2; // reduce the number of shown rows to add space for status bar
+
+	char *budget = getenv("KILO_MEMORY_BUDGET");
+	if (budget) E.mem_budget = parseSize(budget);
+	char *undo = getenv("KILO_UNDO_LIMIT"); // bytes of undo history
+	if (undo) UJ.limit = parseSize(undo);
+	char *cache = getenv("KILO_CACHE"); // files at least this big keep an index cache next to them
+	if (cache) E.cache_min = parseSize(cache);
+
+	char *syntax = getenv("KILO_SYNTAX_DIR"); // more syntaxes, one file per language
+	char syntax_dir[4096];
+	if (syntax == NULL && getenv("HOME")) {
+		snprintf(syntax_dir, sizeof(syntax_dir), "%s/.config/kilo/syntax", getenv("HOME"));
+		syntax = syntax_dir;
+	}
+	editorSyntaxInit(syntax);
+
+	char *trace = getenv("KILO_TRACE"); // where to write a chrome trace of the main loop
+	if (trace && timingTrace(trace) == -1) die(trace);
+
+	// before opening, which can tell about a recovered swap file
+	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-Z/Y = undo/redo | Ctrl-Q = quit");
+
+	if (stream)
+		editorStream(STDIN_FILENO);
+	else if (argc >= 3 && !strcmp(argv[1], "-f"))
+		editorFollow(argv[2]);
+	else if (argc >= 2)
+		editorOpen(argv[1]);
+
+	while (1) {
+		editorRefreshScreen();
+		editorProcessKeypress();
+	}
+	return 0;
+}
@@ -0,0 +1,363 @@
+/**
+ * Kilo microbenchmarks: times the inner loops of the editor core one by one
+ * over generated worst cases, and prints one JSON object per line:
+ *
+ *   {"input":"rows","bench":"updateSyntax","rows":1000000,"bytes":...,
+ *    "reps":3,"sec":0.123456,"mb_s":...,"rows_s":...}
+ *
+ * sec is the time of a single repetition. The output of two commits can be
+ * compared line by line, e.g. with `join` or `jq`.
+ *
+ * usage: microbench [-n rows] [-l bytes] [filter]
+ *
+ * -n sets the rows of the multi row inputs (1M by default), -l the length of
+ * the single line input (10MB by default). Only the benchmarks whose
+ * "input/bench" name contains filter run.
+ */
+
+#include "kilo.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+
+#define MB_MIN_TIME 0.25 // every benchmark repeats for at least this long
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*** generated input ***/
+
+char *code_lines[] = {
+	"/* generated by the kilo microbenchmark */",
+	"#include <stdio.h>",
+	"",
+	"struct point {",
+	"\tint x, y; // coordinates",
+	"};",
+	"",
+	"static int needle_count(char *s, unsigned long len) {",
+	"\tint count = 0;",
+	"\tfor (unsigned long i = 0; i < len; i++) {",
+	"\t\tif (s[i] == '\\n' || s[i] == 'x') count += 2 * 3.5;",
+	"\t}",
+	"\t/* a comment that spans",
+	"\t   more than one row */",
+	"\treturn printf(\"%d needles\\n\", count);",
+	"}",
+	NULL
+};
+
+// nearly every token a keyword, and most of the others numbers
+char *keyword_lines[] = {
+	"static unsigned long int switch_case(signed char c, unsigned int u, double d) {",
+	"\tswitch (c) { case 1: if (u) return 1; else break; case 2: continue; }",
+	"\twhile (1) for (;;) if (2) return 3; else if (4) break; else continue;",
+	"\ttypedef struct s { int a; long b; float c; double d; char e; void *f; } s;",
+	"\tunion u { unsigned char a; signed long b; }; enum e { A = 1, B = 22, C = 333 };",
+	"\treturn 0x10 + 1.5e3 + 42 + 7 + 123456789 + 0.25 + 3 + 99;",
+	"}",
+	NULL
+};
+
+char *tab_lines[] = {
+	"\t\t\tx\t=\t1;\t\t\t// \ttabs\tafter\tevery\tword",
+	"\t\ta\tb\tc\td\te\tf\tg\th\ti\tj\tk\tl\tm\tn\to\tp",
+	"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t",
+	"1\t22\t333\t4444\t55555\t666666\t7777777\t88888888",
+	NULL
+};
+
+// rows open and close comments over and over, and some stay inside one
+char *comment_lines[] = {
+	"/* a /* b */ c /* d */ e /* f */ g /* h */ i /* j",
+	"   k l m n o p q r s t u v w x y z",
+	"*/ int a; /* b */ int c; /* d */ int e; /* f",
+	"*/ /**/ /**/ /**/ /**/ /**/ /**/ /**/ /**/ /**/ /**/",
+	"int x = 1; /* open",
+	"",
+	"   still open */ int y = 2; /* and again */",
+	NULL
+};
+
+// accents, wide chars, combining marks and tabs after them: no row is ASCII
+char *utf8_lines[] = {
+	"/* généré par le microbenchmark de kilo */",
+	"\tprintf(\"%s\\n\", \"日本語のテキスト\");\t// 漢字\tと\tかな",
+	"\tint café = 1; /* naïve señor, Ελληνικά, русский */",
+	"\t\"e\xcc\x81\ta\xcc\x88\to\xcc\x83\" /* combining marks */ 😀\t🚀\t✓",
+	"struct 점 { int x, y; }; // 좌표",
+	NULL
+};
+
+void fillLines(char **lines, int nrows) {
+	int j = 0;
+	for (int i = 0; i < nrows; i++) {
+		if (lines[j] == NULL) j = 0;
+		editorInsertRow(E.numrows, lines[j], strlen(lines[j]));
+		j++;
+	}
+}
+
+int opt_rows = 1000000;
+int opt_line = 10 * 1024 * 1024;
+
+void fillRows() { fillLines(code_lines, opt_rows); }
+void fillKeywords() { fillLines(keyword_lines, opt_rows); }
+void fillTabs() { fillLines(tab_lines, opt_rows); }
+void fillComments() { fillLines(comment_lines, opt_rows); }
+void fillUtf8() { fillLines(utf8_lines, opt_rows); }
+// no comment anywhere: one opened on top runs to the end of the file
+void fillCascade() { fillLines(keyword_lines, opt_rows); }
+
+// one row made of all the others, and a short one so that its end state matters
+void fillLine() {
+	char **sets[] = {code_lines, keyword_lines, tab_lines, comment_lines};
+	char *buf = malloc(opt_line + 1);
+	if (buf == NULL) die("malloc");
+	int len = 0, s = 0, j = 0;
+	while (len < opt_line) {
+		char *l = sets[s][j++];
+		if (l == NULL) {
+			s = (s + 1) % 4;
+			j = 0;
+			continue;
+		}
+		if (strstr(l, "//")) continue; // would end the highlighting
+		int n = strlen(l);
+		if (n > opt_line - len) n = opt_line - len;
+		memcpy(buf + len, l, n);
+		len += n;
+		if (len < opt_line) buf[len++] = ' ';
+	}
+	editorInsertRow(0, buf, len);
+	editorInsertRow(1, "}", 1);
+	free(buf);
+}
+
+struct input {
+	const char *name;
+	void (*fill)();
+};
+
+struct input inputs[] = {
+	{"rows", fillRows},
+	{"keywords", fillKeywords},
+	{"tabs", fillTabs},
+	{"comments", fillComments},
+	{"utf8", fillUtf8},
+	{"line", fillLine},
+	{"cascade", fillCascade},
+};
+
+/*** benchmarks ***/
+
+/*
+ * Every benchmark does one repetition over the whole input and returns the
+ * rows it went through, bytes is set to the bytes it went through.
+ */
+
+long long inputBytes() {
+	long long bytes = 0;
+	for (int j = 0; j < E.numrows; j++) bytes += E.row[j].size;
+	return bytes;
+}
+
+long long benchUpdateRow(long long *bytes) {
+	for (int j = 0; j < E.numrows; j++) editorUpdateRow(&E.row[j]);
+	*bytes = inputBytes();
+	return E.numrows;
+}
+
+long long benchUpdateSyntax(long long *bytes) {
+	for (int j = 0; j < E.numrows; j++) {
+		// a long row keeps its highlighter state between calls: drop it, as
+		// if all of its chars changed, or there is nothing left to time
+		editorLongInvalidate(&E.row[j], 0, E.row[j].size, E.row[j].size);
+		editorUpdateSyntax(&E.row[j]);
+	}
+	*bytes = inputBytes();
+	return E.numrows;
+}
+
+/*
+ * Opens a comment in a new row on top of the file and deletes the row again:
+ * every row whose open comment state changes is highlighted again, twice.
+ * Only those rows count.
+ */
+long long benchCascade(long long *bytes) {
+	char *open = malloc(E.numrows);
+	if (open == NULL) die("malloc");
+	for (int j = 0; j < E.numrows; j++) open[j] = E.row[j].hl_open_comment;
+
+	editorInsertRow(0, "/*", 2);
+	long long rows = 0;
+	*bytes = 0;
+	for (int j = 1; j < E.numrows; j++) {
+		if (E.row[j].hl_open_comment != open[j - 1]) {
+			rows++;
+			*bytes += E.row[j].size;
+		}
+	}
+	editorDelRow(0);
+	editorUpdateSyntax(&E.row[0]);
+	free(open);
+	if (rows == 0) { // a figure of 0 MB/s would pass for a result
+		fprintf(stderr, "syntaxCascade: no row was highlighted again\n");
+		exit(1);
+	}
+	*bytes *= 2;
+	return rows * 2;
+}
+
+/*
+ * Converts every position of every row, so a position is a byte
+ */
+long long benchCxToRx(long long *bytes) {
+	volatile int sink = 0;
+	for (int j = 0; j < E.numrows; j++) {
+		erow *row = &E.row[j];
+		for (int cx = 0; cx <= row->size; cx++) sink += editorRowCxToRx(row, cx);
+	}
+	*bytes = inputBytes();
+	return E.numrows;
+}
+
+long long benchRxToCx(long long *bytes) {
+	volatile int sink = 0;
+	*bytes = 0;
+	for (int j = 0; j < E.numrows; j++) {
+		erow *row = &E.row[j];
+		int rsize = editorRowCxToRx(row, row->size); // long rows only render a window
+		for (int rx = 0; rx <= rsize; rx++) sink += editorRowRxToCx(row, rx);
+		*bytes += rsize;
+	}
+	return E.numrows;
+}
+
+// a query that is nowhere: the search goes through every row
+long long benchFind(long long *bytes) {
+	editorFindCallback("no such needle", 'n');
+	editorFindCallback("no such needle", '\r');
+	*bytes = inputBytes();
+	return E.numrows;
+}
+
+long long benchRowsToString(long long *bytes) {
+	int len;
+	char *buf = editorRowsToString(&len);
+	free(buf);
+	*bytes = len;
+	return E.numrows;
+}
+
+#define MB_FRAMES 256 // screens drawn across the file in every repetition
+
+/*
+ * Draws screens spread over the whole file, or over the whole row when the
+ * file starts with a long row. The bytes are the ones sent to the terminal.
+ */
+long long benchDrawRows(long long *bytes) {
+	long long cols = editorRowCxToRx(&E.row[0], E.row[0].size);
+	*bytes = 0;
+	for (int f = 0; f < MB_FRAMES; f++) {
+		if (E.row[0].ll) {
+			E.rowoff = 0;
+			E.coloff = cols * f / MB_FRAMES;
+		} else {
+			E.rowoff = (long long)E.numrows * f / MB_FRAMES;
+			E.coloff = 0;
+		}
+		struct abuf ab = ABUF_INIT;
+		editorDrawRows(&ab);
+		*bytes += ab.len;
+		abFree(&ab);
+	}
+	E.rowoff = E.coloff = 0;
+	return (long long)MB_FRAMES * E.screenrows;
+}
+
+struct bench {
+	const char *name;
+	long long (*run)(long long *bytes);
+	const char *input; // the only input it runs on, NULL for all of them
+};
+
+struct bench benches[] = {
+	{"updateRow", benchUpdateRow, NULL},
+	{"updateSyntax", benchUpdateSyntax, NULL},
+	{"syntaxCascade", benchCascade, "cascade"},
+	{"cxToRx", benchCxToRx, NULL},
+	{"rxToCx", benchRxToCx, NULL},
+	{"find", benchFind, NULL},
+	{"rowsToString", benchRowsToString, NULL},
+	{"drawRows", benchDrawRows, NULL},
+};
+
+/*** main ***/
+
+void benchReset() {
+	while (E.numrows) editorDelRow(E.numrows - 1);
+	free(E.row);
+	free(E.filename);
+	initEditor();
+	E.screenrows = 50; // a big terminal
+	E.screencols = 200;
+	E.filename = strdup("microbench.c");
+	editorSelectSyntaxHighlight();
+}
+
+int selected(const char *filter, const char *input, struct bench *bench) {
+	if (bench->input && strcmp(bench->input, input)) return 0;
+	char name[64];
+	snprintf(name, sizeof(name), "%s/%s", input, bench->name);
+	return filter == NULL || strstr(name, filter);
+}
+
+int main(int argc, char *argv[]) {
+	char *filter = NULL;
+	for (int j = 1; j < argc; j++) {
+		if (!strcmp(argv[j], "-n") && j + 1 < argc) opt_rows = atoi(argv[++j]);
+		else if (!strcmp(argv[j], "-l") && j + 1 < argc) opt_line = atoi(argv[++j]);
+		else filter = argv[j];
+	}
+	if (opt_rows < 1) opt_rows = 1;
+	if (opt_line < 1) opt_line = 1;
+	setlocale(LC_CTYPE, "C.UTF-8"); // as the editor has it, for the widths of the utf8 input
+
+	initEditor();
+	for (unsigned int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		int wanted = 0;
+		for (unsigned int b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+			wanted |= selected(filter, inputs[i].name, &benches[b]);
+		if (!wanted) continue;
+
+		benchReset();
+		inputs[i].fill();
+
+		for (unsigned int b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+			if (!selected(filter, inputs[i].name, &benches[b])) continue;
+
+			long long rows = 0, bytes = 0;
+			int reps = 0;
+			double start = now(), elapsed;
+			do {
+				rows += benches[b].run(&bytes);
+				reps++;
+				elapsed = now() - start;
+			} while (elapsed < MB_MIN_TIME);
+
+			double sec = elapsed / reps;
+			printf("{\"input\":\"%s\",\"bench\":\"%s\",\"rows\":%lld,\"bytes\":%lld,"
+				"\"reps\":%d,\"sec\":%.6f,\"mb_s\":%.1f,\"rows_s\":%.0f}\n",
+				inputs[i].name, benches[b].name, rows / reps, bytes, reps, sec,
+				bytes / sec / 1e6, rows / elapsed);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}